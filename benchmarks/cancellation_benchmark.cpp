@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// cancellation_benchmark [trials] [keystrokes per trial]
+//                        [interval in us, 0 = full speed]
+//                        [watchdog in ms, 0 = off]
+//
+// times the shutdown chain of kbrdhook: request_stop() on the exit source
+// (as clean_stop does for ctrl-C), stop_when(stop_event(exit)), the stop
+// callback of the pending sender_range operation and clickety returning.
+// each trial replays keystrokes into a range configured like
+// keyboard_hook and fires the stop just before a random one of them, on
+// the replay thread, so that it races with delivery. the time from the
+// request to sync_wait returning is the time to quiescence.
+//
+// with a watchdog, a trial that has not returned within the limit is
+// reported with what it has delivered so far. the exit code is 1 if any
+// was reported.
+
+#include <unifex/inplace_stop_token.hpp>
+#include <unifex/stop_when.hpp>
+#include <unifex/sync_wait.hpp>
+
+#include "clickety.hpp"
+#include "frame_pool.hpp"
+#include "key_event.hpp"
+#include "latency_trace.hpp"
+#include "sender_range.hpp"
+#include "stop_event.hpp"
+#include "stop_watchdog.hpp"
+#include "synthetic_source.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <optional>
+#include <random>
+#include <vector>
+
+// the same buffering and batching as keyboard_hook, over a synthetic_source
+class synthetic_keyboard {
+  using source_t = synthetic_source<key_event>;
+  using RangeType = sender_range<
+      key_event,
+      unifex::inplace_stop_token,
+      decltype(std::declval<source_t&>().register_fn()),
+      decltype(std::declval<source_t&>().unregister_fn()),
+      buffered<64, overflow_policy::drop_oldest>>;
+
+  // never stopped, the trial stops clickety through stop_when
+  unifex::inplace_stop_source stopSource_;
+  RangeType range_;
+
+public:
+  explicit synthetic_keyboard(source_t& source)
+    : range_(
+          stopSource_.get_token(),
+          source.register_fn(),
+          source.unregister_fn()) {}
+
+  template <std::size_t MaxBatch>
+  auto event_batches() {
+    return range_.template batches<MaxBatch>();
+  }
+};
+
+struct counting_player {
+  std::atomic<std::size_t> clicks_{0};
+
+  void Click(latency_trace::stamp_t) {
+    clicks_.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+// what the watchdog prints about a stuck trial
+struct trial_info {
+  std::size_t trial_;
+  std::size_t fireAt_;
+  synthetic_source<key_event>* source_;
+  counting_player* player_;
+
+  static void describe(void* context) noexcept {
+    auto& self = *static_cast<trial_info*>(context);
+    printf(
+        "  trial %zu: stop before keystroke %zu, %zu emitted, %zu clicked\n",
+        self.trial_,
+        self.fireAt_,
+        self.source_->emitted(),
+        self.player_->clicks_.load());
+  }
+};
+
+int main(int argc, char* argv[]) {
+  std::size_t trials = 1000;
+  std::size_t keystrokes = 1000;
+  std::chrono::microseconds interval{0};
+  std::chrono::milliseconds watchdogLimit{0};
+  if (argc > 1) {
+    trials = std::strtoull(argv[1], nullptr, 10);
+  }
+  if (argc > 2) {
+    keystrokes = std::strtoull(argv[2], nullptr, 10);
+  }
+  if (argc > 3) {
+    interval = std::chrono::microseconds(std::strtoll(argv[3], nullptr, 10));
+  }
+  if (argc > 4) {
+    watchdogLimit =
+        std::chrono::milliseconds(std::strtoll(argv[4], nullptr, 10));
+  }
+  if (trials == 0 || keystrokes == 0) {
+    printf(
+        "cancellation_benchmark [trials] [keystrokes per trial] "
+        "[interval in us] [watchdog in ms]\n");
+    return 1;
+  }
+  const auto pacing = interval.count() == 0 ? replay_pacing::full_speed
+                                            : replay_pacing::scripted;
+
+  auto script = generate_script<key_event>(
+      keystrokes, interval, interval / 4, [](std::size_t i) {
+        return key_event{0, 0, 0, (std::uint8_t)('A' + i % 26), 0};
+      });
+
+  std::optional<stop_watchdog> watchdog;
+  if (watchdogLimit.count() != 0) {
+    watchdog.emplace(watchdogLimit);
+  }
+  std::minstd_rand random{1};
+  std::uniform_int_distribution<std::size_t> fireAt{0, keystrokes - 1};
+  frame_pool frames{4096, 2};
+  std::vector<latency_trace::stamp_t> quiescence;
+  quiescence.reserve(trials);
+  std::size_t clicks = 0;
+
+  for (std::size_t trial = 0; trial != trials; ++trial) {
+    synthetic_source<key_event> source;
+    synthetic_keyboard keyboard{source};
+    counting_player player;
+    unifex::inplace_stop_source exit;
+    trial_info info{trial, fireAt(random), &source, &player};
+    std::atomic<latency_trace::stamp_t> firedAt{0};
+    stop_watchdog::watch_id watch = 0;
+
+    source.start(
+        script,
+        pacing,
+        [&, next = std::size_t{0}](key_event&) mutable noexcept {
+          if (next++ != info.fireAt_) {
+            return;
+          }
+          if (watchdog) {
+            watch = watchdog->begin(
+                "clickety shutdown", &trial_info::describe, &info);
+          }
+          firedAt.store(latency_trace::now());
+          exit.request_stop();
+        },
+        []() noexcept {});
+    unifex::sync_wait(
+        clickety(std::allocator_arg, frames, player, keyboard) |
+        unifex::stop_when(stop_event(exit)));
+    const auto returnedAt = latency_trace::now();
+    source.join();
+
+    if (watchdog) {
+      (void)watchdog->end(watch);
+    }
+    quiescence.push_back(returnedAt - firedAt.load());
+    clicks += player.clicks_.load();
+  }
+
+  std::sort(quiescence.begin(), quiescence.end());
+  const auto ticksPerSecond = latency_trace::frequency();
+  auto micros = [&](double p) {
+    auto ticks = quiescence[(std::size_t)(p * (double)(trials - 1))];
+    return (double)ticks * 1000000.0 / (double)ticksPerSecond;
+  };
+  printf(
+      "%zu trials of %zu keystrokes, %zu clicked\n"
+      "time to quiescence (us): p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n",
+      trials,
+      keystrokes,
+      clicks,
+      micros(0.50),
+      micros(0.90),
+      micros(0.99),
+      micros(1.0));
+  auto frameStats = frames.stats();
+  printf(
+      "clickety frames: %zu pooled, %zu from the heap\n",
+      frameStats.pooled_,
+      frameStats.heap_);
+  if (watchdog) {
+    printf("%zu trials reported by the watchdog\n", watchdog->stuck());
+    return watchdog->stuck() == 0 ? 0 : 1;
+  }
+  return 0;
+}
@@ -0,0 +1,396 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// delivery_benchmark [events] [events per second, 0 = as fast as possible]
+//
+// a producer thread emits events at the requested rate through each of the
+// delivery mechanisms used by the examples and by kbrdhook, while the main
+// thread waits for them one sender at a time (with sync_wait, or a receiver of
+// its own). each run reports throughput, drops, allocations per event and a
+// log2 histogram of the latency from emit to the consumer seeing the event.
+//
+// the known_receiver runs are paired with an any_receiver run that waits
+// with the same receiver, so that the two differ only in the dispatch of the
+// completion.
+
+#include <unifex/inplace_stop_token.hpp>
+#include <unifex/receiver_concepts.hpp>
+#include <unifex/sender_concepts.hpp>
+#include <unifex/sync_wait.hpp>
+
+#include "counting_new.hpp"
+#include "sender_range.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <thread>
+
+using bench_clock = std::chrono::steady_clock;
+
+// 8 bytes, so that the atomic slots of event_buffer stay lock-free. sentAt_
+// is the low 32 bits of the emit time in ns, the difference wraps correctly
+// for latencies under 4s.
+struct bench_event {
+  std::uint32_t seq_;
+  std::uint32_t sentAt_;
+};
+
+static constexpr std::uint32_t last_event = ~std::uint32_t{0};
+
+// bucket i counts latencies in [2^i, 2^(i+1)) ns
+struct latency_histogram {
+  std::array<std::size_t, 40> buckets_{};
+  std::size_t count_{0};
+  bench_clock::rep max_{0};
+
+  void add(bench_clock::rep ns) noexcept {
+    ++count_;
+    max_ = std::max(max_, ns);
+    std::size_t bucket = 0;
+    while (bucket + 1 < buckets_.size() && (ns >> (bucket + 1)) != 0) {
+      ++bucket;
+    }
+    ++buckets_[bucket];
+  }
+
+  // upper bound of the bucket that holds the percentile
+  bench_clock::rep percentile(double p) const noexcept {
+    auto target = (std::size_t)(p * (double)count_);
+    std::size_t seen = 0;
+    for (std::size_t bucket = 0; bucket != buckets_.size(); ++bucket) {
+      seen += buckets_[bucket];
+      if (seen > target) {
+        return bench_clock::rep{2} << bucket;
+      }
+    }
+    return max_;
+  }
+
+  void print() const {
+    for (std::size_t bucket = 0; bucket != buckets_.size(); ++bucket) {
+      if (buckets_[bucket] != 0) {
+        printf(
+            "    < %12lldns %10zu\n",
+            (long long)(bench_clock::rep{2} << bucket),
+            buckets_[bucket]);
+      }
+    }
+  }
+};
+
+struct bench_config {
+  std::uint32_t events_;
+  std::uint64_t rate_;
+};
+
+static std::uint32_t now_ns() {
+  return (std::uint32_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+             bench_clock::now().time_since_epoch())
+      .count();
+}
+
+// calls emit(event) at the configured rate on its own thread. emit must
+// accept last_event, which is sent until emit returns true.
+template <typename Emit>
+std::thread start_producer(const bench_config& config, Emit emit) {
+  return std::thread([config, emit]() mutable {
+    const auto start = bench_clock::now();
+    for (std::uint32_t seq = 0; seq != config.events_; ++seq) {
+      if (config.rate_ != 0) {
+        auto due = start +
+            std::chrono::nanoseconds(seq * 1000000000ull / config.rate_);
+        while (bench_clock::now() < due) {
+          std::this_thread::yield();
+        }
+      }
+      (void)emit(bench_event{seq, now_ns()});
+    }
+    while (!emit(bench_event{last_event, now_ns()})) {
+      std::this_thread::yield();
+    }
+  });
+}
+
+struct bench_result {
+  latency_histogram latency_;
+  std::size_t delivered_{0};
+  std::size_t allocations_{0};
+  bench_clock::duration elapsed_{};
+
+  void receive(const bench_event& event) {
+    latency_.add((std::uint32_t)(now_ns() - event.sentAt_));
+    ++delivered_;
+  }
+};
+
+static void report(
+    const char* name, const bench_config& config, const bench_result& result) {
+  auto seconds = std::chrono::duration<double>(result.elapsed_).count();
+  printf(
+      "%s\n"
+      "  delivered %zu of %llu (%llu dropped) in %.3fs, %.0f events/s\n"
+      "  allocations per event %.3f\n"
+      "  latency p50 < %lldns, p99 < %lldns, max %lldns\n",
+      name,
+      result.delivered_,
+      (unsigned long long)config.events_,
+      (unsigned long long)(config.events_ - result.delivered_),
+      seconds,
+      (double)result.delivered_ / seconds,
+      (double)result.allocations_ / (double)config.events_,
+      (long long)result.latency_.percentile(0.50),
+      (long long)result.latency_.percentile(0.99),
+      (long long)result.latency_.max_);
+  result.latency_.print();
+  fflush(stdout);
+}
+
+// the single-slot pending_completion_ atomic from examples/example_1.cpp
+namespace single_slot {
+template <class... Values>
+struct _sender_of {
+  template <template <class...> class Variant, template <class...> class Tuple>
+  using value_types = Variant<Tuple<Values...>>;
+  template <template <class...> class Variant>
+  using error_types = Variant<std::exception_ptr>;
+  static constexpr bool sends_done = true;
+};
+
+struct pending_completion {
+  virtual void complete(const bench_event&) = 0;
+  virtual ~pending_completion() {}
+};
+
+std::atomic<pending_completion*> pending_completion_{nullptr};
+
+// returns false when the event was dropped because no sender was waiting
+static bool on_event(const bench_event& event) {
+  auto* current = pending_completion_.exchange(nullptr);
+  if (current != nullptr) {
+    current->complete(event);
+    return true;
+  }
+  return false;
+}
+
+template <typename Rec>
+struct event_operation : pending_completion {
+  Rec rec_;
+
+  explicit event_operation(Rec rec) : rec_(std::move(rec)) {}
+
+  void complete(const bench_event& event) override final {
+    if (event.seq_ == last_event)
+      unifex::set_done(std::move(rec_));
+    else
+      unifex::set_value(std::move(rec_), event);
+  }
+
+  void start() noexcept {
+    auto* previous = pending_completion_.exchange(this);
+    if (previous != nullptr) {
+      std::terminate();
+    }
+  }
+};
+
+struct event_sender : _sender_of<bench_event> {
+  template <typename Rec>
+  auto connect(Rec rec) {
+    return event_operation<Rec>{std::move(rec)};
+  }
+};
+
+static bench_result run(const bench_config& config) {
+  bench_result result;
+  const auto allocations = allocations_.load();
+  const auto start = bench_clock::now();
+  auto producer = start_producer(config, &on_event);
+  while (auto event = unifex::sync_wait(event_sender{})) {
+    result.receive(*event);
+  }
+  producer.join();
+  result.elapsed_ = bench_clock::now() - start;
+  result.allocations_ = allocations_.load() - allocations;
+  return result;
+}
+}  // namespace single_slot
+
+// sender_range over atomic_intrusive_queue with the given buffering
+namespace queued {
+static auto register_ = [](auto& fn) noexcept { return &fn; };
+static auto unregister_ = [](auto&) noexcept {};
+
+template <
+    typename BufferPolicy,
+    typename Consumer = any_receiver,
+    typename Receive>
+bench_result run(const bench_config& config, Receive receive) {
+  bench_result result;
+  unifex::inplace_stop_source stopSource;
+  auto range = create_event_sender_range<
+      bench_event,
+      BufferPolicy,
+      delivery_policy::single_consumer,
+      Consumer>(stopSource.get_token(), register_, unregister_);
+  auto* emit = *range.get_registration();
+
+  const auto allocations = allocations_.load();
+  const auto start = bench_clock::now();
+  auto producer =
+      start_producer(config, [emit, &stopSource](bench_event event) {
+        if (event.seq_ == last_event) {
+          // completes the pending sender and every later one with done
+          stopSource.request_stop();
+        } else {
+          (*emit)(event);
+        }
+        return true;
+      });
+  receive(range, result);
+  producer.join();
+  result.elapsed_ = bench_clock::now() - start;
+  result.allocations_ = allocations_.load() - allocations;
+  return result;
+}
+
+static auto one_at_a_time = [](auto& range, bench_result& result) {
+  for (auto next : range) {
+    auto event = unifex::sync_wait(std::move(next));
+    if (!event) {
+      break;
+    }
+    result.receive(*event);
+  }
+};
+
+template <std::size_t MaxBatch>
+static auto in_batches = [](auto& range, bench_result& result) {
+  for (auto next : range.template batches<MaxBatch>()) {
+    auto batch = unifex::sync_wait(std::move(next));
+    if (!batch) {
+      break;
+    }
+    for (auto& event : *batch) {
+      result.receive(event);
+    }
+  }
+};
+
+// in place of sync_wait, the one receiver type of a range with
+// known_receiver, or type-erased by any_receiver. the main thread waits on
+// the slot, which outlives the operation that completes it.
+struct slot {
+  enum state { waiting, value, done };
+  std::atomic<state> state_{waiting};
+  bench_event event_{};
+};
+
+struct slot_receiver {
+  slot* slot_;
+
+  void set_value(bench_event event) noexcept {
+    slot_->event_ = event;
+    _complete(slot_, slot::value);
+  }
+  void set_done() noexcept { _complete(slot_, slot::done); }
+  void set_error(std::exception_ptr) noexcept { std::terminate(); }
+
+  // the operation may be destroyed once the state is stored
+  static void _complete(slot* s, slot::state state) noexcept {
+    s->state_.store(state, std::memory_order_release);
+    s->state_.notify_one();
+  }
+};
+
+static auto direct = [](auto& range, bench_result& result) {
+  slot s;
+  for (auto next : range) {
+    s.state_.store(slot::waiting, std::memory_order_relaxed);
+    auto op = unifex::connect(std::move(next), slot_receiver{&s});
+    unifex::start(op);
+    s.state_.wait(slot::waiting, std::memory_order_acquire);
+    if (s.state_.load(std::memory_order_acquire) == slot::done) {
+      break;
+    }
+    result.receive(s.event_);
+  }
+};
+}  // namespace queued
+
+int main(int argc, char* argv[]) {
+  bench_config config{200000, 0};
+  if (argc > 1) {
+    config.events_ = (std::uint32_t)std::min<unsigned long long>(
+        std::strtoull(argv[1], nullptr, 10), last_event - 1);
+  }
+  if (argc > 2) {
+    config.rate_ = std::strtoull(argv[2], nullptr, 10);
+  }
+  if (config.events_ == 0) {
+    printf("delivery_benchmark [events] [events per second]\n");
+    return 1;
+  }
+  if (config.rate_ == 0) {
+    printf(
+        "%llu events as fast as possible\n",
+        (unsigned long long)config.events_);
+  } else {
+    printf(
+        "%llu events at %llu events/s\n",
+        (unsigned long long)config.events_,
+        (unsigned long long)config.rate_);
+  }
+
+  report("pending_completion_", config, single_slot::run(config));
+  report(
+      "sender_range",
+      config,
+      queued::run<unbuffered>(config, queued::one_at_a_time));
+  report(
+      "sender_range buffered<1024>",
+      config,
+      queued::run<buffered<1024>>(config, queued::one_at_a_time));
+  report(
+      "sender_range buffered<1024> batches<16>",
+      config,
+      queued::run<buffered<1024>>(config, queued::in_batches<16>));
+  report(
+      "sender_range any_receiver",
+      config,
+      queued::run<unbuffered>(config, queued::direct));
+  report(
+      "sender_range known_receiver",
+      config,
+      queued::run<unbuffered, known_receiver<queued::slot_receiver>>(
+          config, queued::direct));
+  report(
+      "sender_range buffered<1024> any_receiver",
+      config,
+      queued::run<buffered<1024>>(config, queued::direct));
+  report(
+      "sender_range buffered<1024> known_receiver",
+      config,
+      queued::run<buffered<1024>, known_receiver<queued::slot_receiver>>(
+          config, queued::direct));
+}
@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// layout_benchmark [events] [max consumers]
+//
+// false sharing between the fields that different threads write. a
+// producer publishes events through a ring index while consumers claim
+// them with a CAS, like event_buffer under a load-balanced sender_range,
+// and the producer reads a pointer that is almost never written, like
+// _keyboard_hook::self_. the same fields are laid out packed and then one
+// per cache line. the last run is event_buffer itself, which is padded.
+
+#include "cache_line.hpp"
+#include "event_buffer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+static constexpr std::size_t ring_capacity = 1024;
+
+// Align is alignof(atomic) to pack the fields or cache_line_size to keep
+// them apart
+template <std::size_t Align>
+struct ring_fields {
+  // claimed by every consumer
+  alignas(Align) std::atomic<std::uint64_t> head_{0};
+  // written by the producer
+  alignas(Align) std::atomic<std::uint64_t> tail_{0};
+  // read by the producer for each event
+  alignas(Align) std::atomic<void*> self_{nullptr};
+  // written by each consumer for each event
+  alignas(Align) std::atomic<std::uint64_t> consumed_{0};
+};
+
+using packed = ring_fields<alignof(std::atomic<std::uint64_t>)>;
+using padded = ring_fields<cache_line_size>;
+
+struct bench_result {
+  double seconds_{0};
+  std::uint64_t consumed_{0};
+};
+
+template <typename Fields>
+bench_result run_fields(std::uint64_t events, std::size_t consumers) {
+  Fields fields;
+  int hook = 0;
+  fields.self_.store(&hook);
+  std::atomic<bool> done{false};
+
+  const auto start = bench_clock::now();
+  std::vector<std::thread> threads;
+  for (std::size_t c = 0; c != consumers; ++c) {
+    threads.emplace_back([&] {
+      for (;;) {
+        auto head = fields.head_.load(std::memory_order_acquire);
+        if (head == fields.tail_.load(std::memory_order_acquire)) {
+          if (done.load(std::memory_order_acquire) &&
+              head == fields.tail_.load(std::memory_order_acquire)) {
+            return;
+          }
+          std::this_thread::yield();
+          continue;
+        }
+        if (fields.head_.compare_exchange_weak(
+                head, head + 1, std::memory_order_acq_rel)) {
+          fields.consumed_.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    });
+  }
+  std::uint64_t seen = 0;
+  for (std::uint64_t tail = 0; tail != events; ++tail) {
+    while (tail - fields.head_.load(std::memory_order_acquire) >=
+           ring_capacity) {
+      // full, wait for the consumers
+      std::this_thread::yield();
+    }
+    seen += fields.self_.load(std::memory_order_acquire) == &hook;
+    fields.tail_.store(tail + 1, std::memory_order_release);
+  }
+  done.store(true, std::memory_order_release);
+  for (auto& t : threads) {
+    t.join();
+  }
+  if (seen != events) {
+    std::terminate();
+  }
+  return {
+      std::chrono::duration<double>(bench_clock::now() - start).count(),
+      fields.consumed_.load()};
+}
+
+bench_result run_event_buffer(std::uint64_t events, std::size_t consumers) {
+  event_buffer<std::uint64_t, ring_capacity, overflow_policy::drop_newest>
+      buffer;
+  std::atomic<std::uint64_t> consumed{0};
+  std::atomic<bool> done{false};
+
+  const auto start = bench_clock::now();
+  std::vector<std::thread> threads;
+  for (std::size_t c = 0; c != consumers; ++c) {
+    threads.emplace_back([&] {
+      std::uint64_t mine = 0;
+      for (;;) {
+        if (buffer.try_pop()) {
+          ++mine;
+        } else if (done.load(std::memory_order_acquire) && buffer.empty()) {
+          break;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+      consumed.fetch_add(mine, std::memory_order_relaxed);
+    });
+  }
+  for (std::uint64_t i = 0; i != events; ++i) {
+    buffer.push(i);
+  }
+  done.store(true, std::memory_order_release);
+  for (auto& t : threads) {
+    t.join();
+  }
+  return {
+      std::chrono::duration<double>(bench_clock::now() - start).count(),
+      consumed.load() + buffer.dropped()};
+}
+
+static void report(
+    const char* name,
+    std::size_t consumers,
+    std::uint64_t events,
+    const bench_result& result) {
+  printf(
+      "  %-24s %2zu consumers  %8.3fs  %12.0f events/s%s\n",
+      name,
+      consumers,
+      result.seconds_,
+      (double)events / result.seconds_,
+      result.consumed_ == events ? "" : "  (lost events)");
+  fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+  std::uint64_t events = 10000000;
+  std::size_t maxConsumers = 4;
+  if (argc > 1) {
+    events = std::strtoull(argv[1], nullptr, 10);
+  }
+  if (argc > 2) {
+    maxConsumers = std::strtoull(argv[2], nullptr, 10);
+  }
+  if (events == 0 || maxConsumers == 0) {
+    printf("layout_benchmark [events] [max consumers]\n");
+    return 1;
+  }
+  printf(
+      "%llu events, cache line %zu bytes, packed fields %zu bytes, padded "
+      "%zu bytes\n",
+      (unsigned long long)events,
+      cache_line_size,
+      sizeof(packed),
+      sizeof(padded));
+  for (std::size_t consumers = 1; consumers <= maxConsumers; consumers *= 2) {
+    report("packed", consumers, events, run_fields<packed>(events, consumers));
+    report("padded", consumers, events, run_fields<padded>(events, consumers));
+    report(
+        "event_buffer (padded)",
+        consumers,
+        events,
+        run_event_buffer(events, consumers));
+  }
+}
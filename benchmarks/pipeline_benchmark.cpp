@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// pipeline_benchmark [keystrokes] [interval in us, 0 = full speed]
+//                    [throttle in us, 0 = off] [debounce in us, 0 = off]
+//
+// runs the clickety coroutine from kbrdhook headless. a synthetic_source
+// replays generated keystrokes into a sender_range configured like
+// keyboard_hook, and a player that only counts stands in for the audio.
+// allocations are counted by a replaced global operator new, so that the
+// steady state can be checked for zero allocations per keystroke. with a
+// throttle the keystrokes it drops never reach the range.
+//
+// the debounce is on windows only. its timers are on a timer_wheel over an
+// iocp_context, which then also counts in the allocations.
+
+#include <unifex/inplace_stop_token.hpp>
+#include <unifex/sync_wait.hpp>
+
+#include "clickety.hpp"
+#include "counting_new.hpp"
+#include "frame_pool.hpp"
+#include "key_event.hpp"
+#include "latency_trace.hpp"
+#include "rate_limit.hpp"
+#include "sender_range.hpp"
+#include "synthetic_source.hpp"
+#if defined(_WIN32)
+#include "iocp_context.hpp"
+#include "timer_wheel.hpp"
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include <thread>
+
+// the same buffering and batching as keyboard_hook, over a synthetic_source
+// whose keystrokes may first go through the adaptors of rate_limit.hpp
+template <typename RegisterFn>
+class synthetic_keyboard {
+  using source_t = synthetic_source<key_event>;
+  using RangeType = sender_range<
+      key_event,
+      unifex::inplace_stop_token,
+      RegisterFn,
+      decltype(std::declval<source_t&>().unregister_fn()),
+      buffered<64, overflow_policy::drop_oldest>>;
+
+  unifex::inplace_stop_source stopSource_;
+  RangeType range_;
+
+public:
+  synthetic_keyboard(source_t& source, RegisterFn registerFn)
+    : range_(
+          stopSource_.get_token(),
+          std::move(registerFn),
+          source.unregister_fn()) {}
+
+  void request_stop() { stopSource_.request_stop(); }
+
+  // lost to the buffer
+  std::size_t dropped() const noexcept { return range_.dropped(); }
+
+  template <std::size_t MaxBatch>
+  auto event_batches() {
+    return range_.template batches<MaxBatch>();
+  }
+};
+
+struct counting_player {
+  std::atomic<std::size_t> clicks_{0};
+
+  void Click(latency_trace::stamp_t hookTime) {
+    latency_trace::mark(latency_trace::schedule, hookTime);
+    clicks_.fetch_add(1, std::memory_order_relaxed);
+  }
+};
+
+// replays script through registerFn into clickety and reports. filtered()
+// is the number of keystrokes that the adaptors in registerFn removed.
+template <typename RegisterFn, typename Filtered>
+void run_pipeline(
+    synthetic_source<key_event>& source,
+    RegisterFn registerFn,
+    Filtered filtered,
+    const event_script<key_event>& script,
+    replay_pacing pacing) {
+  synthetic_keyboard<RegisterFn> keyboard{source, std::move(registerFn)};
+  counting_player player;
+  frame_pool frames{4096, 2};
+  auto dropped = [&]() noexcept { return keyboard.dropped() + filtered(); };
+
+  const auto allocations = allocations_.load();
+  const auto start = std::chrono::steady_clock::now();
+  source.start(
+      script,
+      pacing,
+      [](key_event& key) noexcept {
+        // dispatch is marked by the range, resume by clickety and schedule
+        // by the player
+        key.hookTime_ = latency_trace::now();
+      },
+      [&]() noexcept {
+        // let clickety catch up with the buffer before stopping it
+        while (player.clicks_.load() + dropped() < source.emitted()) {
+          std::this_thread::yield();
+        }
+        keyboard.request_stop();
+      });
+  unifex::sync_wait(clickety(std::allocator_arg, frames, player, keyboard));
+  const auto elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+  // the replay thread is the only allocation expected in the run
+  const auto allocated = allocations_.load() - allocations;
+  source.join();
+
+  printf(
+      "%zu keystrokes, %zu clicks, %zu dropped in %.3fs (%.0f clicks/s)\n",
+      source.emitted(),
+      player.clicks_.load(),
+      dropped(),
+      elapsed,
+      (double)player.clicks_.load() / elapsed);
+  auto frameStats = frames.stats();
+  printf(
+      "%zu allocations (%.4f per keystroke), clickety frames: %zu pooled, "
+      "%zu from the heap\n",
+      allocated,
+      (double)allocated / (double)std::max<std::size_t>(source.emitted(), 1),
+      frameStats.pooled_,
+      frameStats.heap_);
+}
+
+int main(int argc, char* argv[]) {
+  std::size_t keystrokes = 100000;
+  std::chrono::microseconds interval{0};
+  std::chrono::microseconds throttleInterval{0};
+  std::chrono::microseconds debounceInterval{0};
+  if (argc > 1) {
+    keystrokes = std::strtoull(argv[1], nullptr, 10);
+  }
+  if (argc > 2) {
+    interval = std::chrono::microseconds(std::strtoll(argv[2], nullptr, 10));
+  }
+  if (argc > 3) {
+    throttleInterval =
+        std::chrono::microseconds(std::strtoll(argv[3], nullptr, 10));
+  }
+  if (argc > 4) {
+    debounceInterval =
+        std::chrono::microseconds(std::strtoll(argv[4], nullptr, 10));
+  }
+  const auto pacing = interval.count() == 0 ? replay_pacing::full_speed
+                                            : replay_pacing::scripted;
+
+  auto script = generate_script<key_event>(
+      keystrokes, interval, interval / 4, [](std::size_t i) {
+        return key_event{0, 0, 0, (std::uint8_t)('A' + i % 26), 0};
+      });
+
+  synthetic_source<key_event> source;
+  throttle<key_event> repeats{throttleInterval};
+#if defined(_WIN32)
+  if (debounceInterval.count() != 0) {
+    iocp_context workers{2};
+    timer_wheel wheel{workers};
+    debounce<key_event, timer_wheel> quiet{wheel, debounceInterval};
+    run_pipeline(
+        source,
+        quiet.wrap(repeats.wrap(source.register_fn())),
+        [&]() noexcept { return repeats.dropped() + quiet.dropped(); },
+        script,
+        pacing);
+    latency_trace::instance().print_summary();
+    return 0;
+  }
+#else
+  if (debounceInterval.count() != 0) {
+    printf("the debounce needs iocp_context, it is windows only\n");
+    return 1;
+  }
+#endif
+  run_pipeline(
+      source,
+      repeats.wrap(source.register_fn()),
+      [&]() noexcept { return repeats.dropped(); },
+      script,
+      pacing);
+  latency_trace::instance().print_summary();
+}
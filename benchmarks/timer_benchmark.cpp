@@ -0,0 +1,195 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// timer_benchmark [timers] [tick in us] [longest delay in ms]
+//
+// arms preallocated timers at delays spread evenly over the log of the
+// delay, up to the longest, so that they land on every level of the
+// timer_wheel it covers and come down through its cascades. every other
+// timer is cancelled as soon as it is armed. the same workload then runs
+// on the deadline ordered list of iocp_context, which the wheel sits on.
+//
+// each run reports the cost of an arm and of a cancel as seen by the
+// caller, and how late the timers ran. the exit code is 1 if a timer ran
+// early, ran more than once, or did not run as cancelled when it was.
+//
+// windows only, both run on the workers of an iocp_context.
+
+#include "iocp_context.hpp"
+#include "timer_wheel.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using bench_clock = iocp_context::clock_t;
+
+struct run_result {
+  double armNs_{0};
+  double cancelNs_{0};
+  std::size_t expired_{0};
+  std::size_t cancelled_{0};
+  // expired before their deadline, ran twice, or cancelled but expired
+  std::size_t wrong_{0};
+  std::vector<std::int64_t> lateNs_;
+};
+
+template <typename Timers>
+struct bench_timer : Timers::timer_item {
+  run_result* result_;
+  std::atomic<std::size_t>* done_;
+  bool cancel_;
+  std::atomic<int> runs_{0};
+  std::int64_t lateNs_{0};
+
+  static void _execute(iocp_context::work_item* work) noexcept {
+    auto& t = *static_cast<bench_timer*>(work);
+    const auto now = bench_clock::now();
+    if (t.runs_.fetch_add(1) == 0 && !t.cancelled()) {
+      t.lateNs_ =
+          std::chrono::duration_cast<std::chrono::nanoseconds>(now - t.due_)
+              .count();
+    }
+    t.done_->fetch_add(1, std::memory_order_release);
+  }
+};
+
+template <typename Timers>
+run_result
+run(Timers& timers, const std::vector<bench_clock::duration>& delays) {
+  using timer_t = bench_timer<Timers>;
+  run_result result;
+  std::atomic<std::size_t> done{0};
+  std::vector<std::unique_ptr<timer_t>> items;
+  items.reserve(delays.size());
+  for (std::size_t i = 0; i != delays.size(); ++i) {
+    items.emplace_back(
+        new timer_t{{{&timer_t::_execute}, {}}, &result, &done, i % 2 == 1});
+  }
+
+  bench_clock::duration armTime{0};
+  bench_clock::duration cancelTime{0};
+  for (std::size_t i = 0; i != items.size(); ++i) {
+    auto& item = *items[i];
+    const auto start = bench_clock::now();
+    timers.arm(item, start + delays[i]);
+    const auto armed = bench_clock::now();
+    armTime += armed - start;
+    if (item.cancel_) {
+      timers.disarm(item);
+      cancelTime += bench_clock::now() - armed;
+    }
+  }
+  while (done.load(std::memory_order_acquire) != items.size()) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  const auto count = (double)items.size();
+  result.armNs_ =
+      std::chrono::duration<double, std::nano>(armTime).count() / count;
+  result.cancelNs_ = std::chrono::duration<double, std::nano>(cancelTime)
+                         .count() /
+      std::max(1.0, std::floor(count / 2));
+  for (auto& item : items) {
+    const bool cancelled = item->cancelled();
+    if (item->runs_.load() != 1 || (item->cancel_ && !cancelled) ||
+        (!cancelled && item->lateNs_ < 0)) {
+      ++result.wrong_;
+    }
+    if (cancelled) {
+      ++result.cancelled_;
+    } else {
+      ++result.expired_;
+      result.lateNs_.push_back(item->lateNs_);
+    }
+  }
+  std::sort(result.lateNs_.begin(), result.lateNs_.end());
+  return result;
+}
+
+static std::int64_t percentile(
+    const std::vector<std::int64_t>& sorted, double p) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  return sorted[std::min(
+      sorted.size() - 1, (std::size_t)(p * (double)sorted.size()))];
+}
+
+static bool report(const char* name, const run_result& r) {
+  printf("%s\n", name);
+  printf(
+      "  arm %.0fns, cancel %.0fns, %zu expired, %zu cancelled\n",
+      r.armNs_,
+      r.cancelNs_,
+      r.expired_,
+      r.cancelled_);
+  printf(
+      "  late p50 %lldus, p99 %lldus, max %lldus\n",
+      (long long)percentile(r.lateNs_, 0.5) / 1000,
+      (long long)percentile(r.lateNs_, 0.99) / 1000,
+      (long long)(r.lateNs_.empty() ? 0 : r.lateNs_.back()) / 1000);
+  if (r.wrong_ != 0) {
+    printf("  %zu timers ran early, twice or not as cancelled\n", r.wrong_);
+  }
+  fflush(stdout);
+  return r.wrong_ == 0;
+}
+
+int main(int argc, char* argv[]) {
+  std::size_t timers = 20000;
+  std::chrono::microseconds tick{100};
+  std::chrono::milliseconds longest{1000};
+  if (argc > 1) {
+    timers = std::strtoull(argv[1], nullptr, 10);
+  }
+  if (argc > 2) {
+    tick = std::chrono::microseconds(std::strtoll(argv[2], nullptr, 10));
+  }
+  if (argc > 3) {
+    longest = std::chrono::milliseconds(std::strtoll(argv[3], nullptr, 10));
+  }
+
+  // even in log(delay), from a tick to the longest
+  std::vector<bench_clock::duration> delays;
+  delays.reserve(timers);
+  std::minstd_rand random{7};
+  const double low = std::log((double)tick.count());
+  const double high =
+      std::log((double)std::chrono::microseconds(longest).count());
+  std::uniform_real_distribution<double> spread{low, std::max(low, high)};
+  for (std::size_t i = 0; i != timers; ++i) {
+    delays.push_back(std::chrono::microseconds(
+        (std::int64_t)std::exp(spread(random))));
+  }
+
+  iocp_context workers{2};
+  bool ok = true;
+  {
+    timer_wheel wheel{workers, tick};
+    ok = report("timer_wheel", run(wheel, delays)) && ok;
+  }
+  ok = report("iocp_context", run(workers, delays)) && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <Windows.h>
+
+// Console key presses without a thread blocked in _getch().
+//
+// One thread waits on every added console input handle and on a wake
+// event, so stop() (and the destructor) return at once instead of after
+// the next key. Console handles do not support overlapped reads, so they
+// cannot be bound to an I/O completion port; the wait is the asynchronous
+// part, and ReadConsoleInputW only runs once input is available.
+class console_input {
+public:
+  using callback_t = void (*)(char);
+
+  console_input()
+    : wake_(::CreateEventW(NULL, FALSE, FALSE, NULL)) {
+    if (wake_ == NULL)
+      std::terminate();
+    thread_ = std::thread([this] { run(); });
+  }
+  ~console_input() {
+    stop();
+    thread_.join();
+    for (auto& source : sources_)
+      ::SetConsoleMode(source.input_, source.mode_);
+    ::CloseHandle(wake_);
+  }
+  console_input(console_input&&) = delete;
+
+  // calls callback with each character typed into input, until it is given
+  // CTRL_C. like _getch(), the input is read raw, so ctrl-C arrives as a
+  // character. up to MAXIMUM_WAIT_OBJECTS - 1 inputs share the thread.
+  void add(HANDLE input, callback_t callback) {
+    DWORD mode = 0;
+    if (!::GetConsoleMode(input, &mode))
+      std::terminate();
+    ::SetConsoleMode(
+        input,
+        mode & ~(ENABLE_PROCESSED_INPUT | ENABLE_LINE_INPUT |
+                 ENABLE_ECHO_INPUT));
+    {
+      std::lock_guard lock{lock_};
+      if (sources_.size() + 1 == MAXIMUM_WAIT_OBJECTS)
+        std::terminate();
+      sources_.push_back({input, mode, callback});
+      changed_ = true;
+    }
+    ::SetEvent(wake_);
+  }
+
+  void stop() {
+    {
+      std::lock_guard lock{lock_};
+      stopping_ = true;
+    }
+    ::SetEvent(wake_);
+  }
+
+private:
+  static constexpr char CTRL_C = (char)0x03;
+
+  struct source {
+    HANDLE input_;
+    DWORD mode_;  // restored by the destructor
+    callback_t callback_;
+  };
+
+  void run() {
+    std::vector<source> current;
+    std::vector<HANDLE> waits{wake_};
+    for (;;) {
+      {
+        std::lock_guard lock{lock_};
+        if (stopping_)
+          return;
+        if (changed_) {
+          current = sources_;
+          waits.resize(1);
+          for (auto& s : current)
+            waits.push_back(s.input_);
+          changed_ = false;
+        }
+      }
+      DWORD result = ::WaitForMultipleObjects(
+          (DWORD)waits.size(), waits.data(), FALSE, INFINITE);
+      if (result == WAIT_OBJECT_0)
+        continue;  // stop() or add()
+      DWORD index = result - WAIT_OBJECT_0 - 1;
+      if (index >= current.size())
+        std::terminate();
+      if (!read(current[index]))
+        remove(current[index].input_);
+    }
+  }
+
+  // returns false once CTRL_C has been read
+  static bool read(const source& s) {
+    INPUT_RECORD records[16];
+    DWORD count = 0;
+    if (!::ReadConsoleInputW(s.input_, records, 16, &count))
+      std::terminate();
+    for (DWORD i = 0; i != count; ++i) {
+      if (records[i].EventType != KEY_EVENT)
+        continue;
+      auto& key = records[i].Event.KeyEvent;
+      const WCHAR wch = key.uChar.UnicodeChar;
+      if (!key.bKeyDown || wch == 0)
+        continue;
+      // the W records hold UTF-16, the callback is given the character in
+      // the input code page. half of a surrogate pair does not convert.
+      char bytes[8];
+      const int length = ::WideCharToMultiByte(
+          ::GetConsoleCP(), 0, &wch, 1, bytes, sizeof(bytes), NULL, NULL);
+      for (WORD repeat = 0; repeat != key.wRepeatCount; ++repeat) {
+        for (int b = 0; b != length; ++b)
+          s.callback_(bytes[b]);
+        if (wch == (WCHAR)CTRL_C)
+          return false;
+      }
+    }
+    return true;
+  }
+
+  void remove(HANDLE input) {
+    std::lock_guard lock{lock_};
+    std::erase_if(sources_, [input](auto& s) {
+      if (s.input_ != input)
+        return false;
+      ::SetConsoleMode(s.input_, s.mode_);
+      return true;
+    });
+    changed_ = true;
+  }
+
+  HANDLE wake_;
+  std::mutex lock_;
+  std::vector<source> sources_;
+  bool changed_ = false;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+// reads the process console on a shared console_input
+inline void register_keyboard_callback(console_input::callback_t callback) {
+  static console_input input;
+  input.add(::GetStdHandle(STD_INPUT_HANDLE), callback);
+}
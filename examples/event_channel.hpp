@@ -0,0 +1,273 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/detail/atomic_intrusive_queue.hpp>
+#include <unifex/detail/intrusive_queue.hpp>
+
+#include <unifex/receiver_concepts.hpp>
+#include <unifex/get_stop_token.hpp>
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// A multi-waiter replacement for the single pending_completion_ slot.
+//
+// Any number of receive() senders may be pending at once, from any thread.
+// A sender completes with the next value sent to it, or with done when it
+// is stopped or the channel is closed.
+//
+// Starting a receive() only pushes the waiter onto a lock-free intrusive
+// list (unifex's atomic_intrusive_queue), and a stop request or close()
+// never waits. The sends take turns on the waiters, each for as long as it
+// takes to pick the waiters it completes, and complete them after handing
+// the list back. The waiters are kept in the order they started, so
+// send_one() completes the longest waiting one.
+//
+//   event_channel<char> keyclicks;
+//   // producer
+//   keyclicks.send_all(ch);
+//   // consumers, on any thread
+//   std::optional<char> ch =
+//     co_await unifex::done_as_optional(keyclicks.receive());
+template <class T>
+class event_channel {
+  struct waiter {
+    // value is nullptr for done
+    void (*complete_)(waiter*, T* value) noexcept;
+    waiter* next_{nullptr};
+    // set by the stop callback of this waiter
+    std::atomic<bool> stopRequested_{false};
+  };
+
+  using waiter_list = unifex::intrusive_queue<waiter, &waiter::next_>;
+
+  template <class Rec>
+  struct receive_operation : waiter {
+    struct on_stop {
+      receive_operation* self_;
+      void operator()() const noexcept {
+        self_->channel_->_stop(*self_);
+      }
+    };
+    using stop_callback_t = typename unifex::stop_token_type_t<
+        Rec>::template callback_type<on_stop>;
+
+    event_channel* channel_;
+    Rec rec_;
+    std::optional<stop_callback_t> onStop_{};
+
+    receive_operation(event_channel* channel, Rec rec)
+      : waiter{&_complete}
+      , channel_(channel)
+      , rec_(std::move(rec)) {}
+    receive_operation(receive_operation&&) = delete;
+
+    static void _complete(waiter* w, T* value) noexcept {
+      auto& self = *static_cast<receive_operation*>(w);
+      self.onStop_.reset();
+      if (value != nullptr)
+        unifex::set_value(std::move(self.rec_), std::move(*value));
+      else
+        unifex::set_done(std::move(self.rec_));
+    }
+
+    void start() noexcept {
+      // this may complete as soon as it is in the list
+      auto* channel = channel_;
+      // read before the stop callback is registered, so that a stop
+      // request that races with the enqueue below is seen after it
+      auto epoch = channel->epoch_.load();
+      onStop_.emplace(unifex::get_stop_token(rec_), on_stop{this});
+      (void)channel->waiters_.enqueue(this);
+      if (channel->epoch_.load() != epoch || channel->closed_.load()) {
+        // a stop request or close() that did not see this in the list
+        channel->_poke();
+      }
+    }
+  };
+
+  struct receive_sender {
+    template <
+        template <class...> class Variant,
+        template <class...> class Tuple>
+    using value_types = Variant<Tuple<T>>;
+    template <template <class...> class Variant>
+    using error_types = Variant<std::exception_ptr>;
+    static constexpr bool sends_done = true;
+
+    event_channel* channel_;
+
+    template <unifex::receiver_of<T> Rec>
+    receive_operation<Rec> connect(Rec rec) {
+      return {channel_, std::move(rec)};
+    }
+  };
+
+public:
+  event_channel() = default;
+  event_channel(event_channel&&) = delete;
+  ~event_channel() {
+    // waiters must not outlive the channel
+    close();
+  }
+
+  // a sender that completes with the next value sent after it starts
+  receive_sender receive() noexcept { return {this}; }
+
+  // completes the longest waiting receiver with value. returns false when
+  // no receiver was waiting and the value was dropped.
+  bool send_one(T value) {
+    _acquire();
+    waiter_list done;
+    _collect(done);
+    waiter* sent = nullptr;
+    while (!ordered_.empty() && !sent) {
+      auto* w = ordered_.pop_front();
+      if (w->stopRequested_.load()) {
+        done.push_back(w);
+      } else {
+        sent = w;
+      }
+    }
+    _release(done);
+    _complete_done(done);
+    if (!sent) {
+      return false;
+    }
+    sent->complete_(sent, &value);
+    return true;
+  }
+
+  // completes every waiting receiver with a copy of value. returns the
+  // number of receivers that got it.
+  std::size_t send_all(const T& value) {
+    _acquire();
+    waiter_list done;
+    _collect(done);
+    auto pending = std::exchange(ordered_, waiter_list{});
+    _release(done);
+    _complete_done(done);
+    std::size_t sent = 0;
+    while (!pending.empty()) {
+      auto* w = pending.pop_front();
+      if (w->stopRequested_.load()) {
+        w->complete_(w, nullptr);
+      } else {
+        T copy = value;
+        w->complete_(w, &copy);
+        ++sent;
+      }
+    }
+    return sent;
+  }
+
+  // completes every waiting receiver, and every later one, with done
+  void close() noexcept {
+    closed_.store(true);
+    _poke();
+  }
+
+private:
+  // called from the stop callback of a waiter. the waiter is completed by
+  // whoever has the list next.
+  void _stop(waiter& w) noexcept {
+    w.stopRequested_.store(true);
+    _poke();
+  }
+
+  // asks for the stopped waiters to be completed, and all of them once
+  // closed. never waits, when the list is taken its owner does it.
+  void _poke() noexcept {
+    epoch_.fetch_add(1);
+    if (owner_.exchange(true)) {
+      // seq_cst pairs with _release(), the owner sees the new epoch
+      return;
+    }
+    waiter_list done;
+    _collect(done);
+    _release(done);
+    _complete_done(done);
+  }
+
+  // takes the list, after any other send
+  void _acquire() noexcept {
+    while (owner_.exchange(true)) {
+      owner_.wait(true);
+    }
+  }
+
+  // owner only. moves the started waiters behind the ones already in order
+  // and, when poked, takes out the stopped ones, or all of them once closed.
+  void _collect(waiter_list& done) noexcept {
+    const auto epoch = epoch_.load();
+    for (auto started = waiters_.dequeue_all(); !started.empty();) {
+      ordered_.push_back(started.pop_front());
+    }
+    if (epoch == seenEpoch_) {
+      return;
+    }
+    seenEpoch_ = epoch;
+    const bool closed = closed_.load();
+    waiter_list keep;
+    while (!ordered_.empty()) {
+      auto* w = ordered_.pop_front();
+      if (closed || w->stopRequested_.load()) {
+        done.push_back(w);
+      } else {
+        keep.push_back(w);
+      }
+    }
+    ordered_ = std::move(keep);
+  }
+
+  // hands the list back. a poke that found it taken is collected first.
+  void _release(waiter_list& done) noexcept {
+    for (;;) {
+      const auto seen = seenEpoch_;
+      owner_.store(false);
+      owner_.notify_one();
+      if (epoch_.load() == seen || owner_.exchange(true)) {
+        // nothing was missed, or the new owner collects it
+        return;
+      }
+      _collect(done);
+    }
+  }
+
+  static void _complete_done(waiter_list& done) noexcept {
+    while (!done.empty()) {
+      auto* w = done.pop_front();
+      w->complete_(w, nullptr);
+    }
+  }
+
+  // started waiters, pushed without taking the list
+  unifex::atomic_intrusive_queue<waiter, &waiter::next_> waiters_;
+  // set while a send or a poke has the list
+  std::atomic<bool> owner_{false};
+  // the waiters in the order they started, owner only
+  waiter_list ordered_;
+  // bumped by every stop request of a waiter and by close()
+  std::atomic<std::size_t> epoch_{0};
+  // the epoch of the last _collect(), owner only
+  std::size_t seenEpoch_{0};
+  std::atomic<bool> closed_{false};
+};
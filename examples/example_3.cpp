@@ -22,45 +22,12 @@
 #include <cassert>
 #include <chrono>
 #include <ranges>
-#include <stop_token>
 
 #include <Windows.h>
-#include <conio.h>
 
-static constexpr char CTRL_C = (char)0x03;
-
-// A rough approximation of C++20's std::jthread,
-// because MSVC doesn't have it yet.
-struct jthread {
-  std::stop_source stop_;
-  std::thread thread_;
-
-  template <class Fn, class... Args>
-  jthread(Fn fn, Args... args)
-    : stop_()
-    , thread_(
-          [token = stop_.get_token()](auto fn, auto... args) {
-            fn(token, args...);
-          },
-          fn,
-          args...) {}
-
-  ~jthread() {
-    stop_.request_stop();
-    thread_.join();
-  }
-};
+#include "console_input.hpp"
 
-void register_keyboard_callback(void (*callback)(char)) {
-  static jthread th([=](auto token) {
-    while (!token.stop_requested()) {
-      int ch = _getch();
-      callback((char)ch);
-      if (ch == CTRL_C)
-        break;
-    }
-  });
-}
+static constexpr char CTRL_C = (char)0x03;
 
 // Implementation detail, the shape of which is likely to evolve.
 template <class... Values>
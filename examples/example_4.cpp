@@ -24,45 +24,12 @@
 #include <cassert>
 #include <chrono>
 #include <ranges>
-#include <stop_token>
 
-#include <conio.h>
 #include <Windows.h>
 
-static constexpr char CTRL_C = (char)0x03;
+#include "console_input.hpp"
 
-// A rough approximation of C++20's std::jthread,
-// because MSVC doesn't have it yet.
-struct jthread {
-  std::stop_source stop_;
-  std::thread thread_;
-
-  template <class Fn, class... Args>
-  jthread(Fn fn, Args... args)
-    : stop_()
-    , thread_(
-          [token = stop_.get_token()](auto fn, auto... args) {
-            fn(token, args...);
-          },
-          fn,
-          args...) {}
-
-  ~jthread() {
-    stop_.request_stop();
-    thread_.join();
-  }
-};
-
-void register_keyboard_callback(void (*callback)(char)) {
-  static jthread th([=](auto token) {
-    while (!token.stop_requested()) {
-      int ch = _getch();
-      callback((char)ch);
-      if (ch == CTRL_C)
-        break;
-    }
-  });
-}
+static constexpr char CTRL_C = (char)0x03;
 
 // Implementation detail, the shape of which is likely to evolve.
 template <class... Values>
@@ -90,10 +57,13 @@ static void on_keyclick(char ch) {
 }
 
 struct cancel_keyclick {
+  pending_completion* op_;
   void operator()() const noexcept {
-    auto* current = pending_completion_.exchange(nullptr);
-    if (current != nullptr) {
-      current->cancel();
+    // take only the operation that was asked to stop, and only if a
+    // keyclick has not taken it first
+    pending_completion* expected = op_;
+    if (pending_completion_.compare_exchange_strong(expected, nullptr)) {
+      op_->cancel();
     }
   }
 };
@@ -105,28 +75,56 @@ using stop_callback_for_t =
 template <unifex::receiver_of<char> Rec>
 struct keyclick_operation : pending_completion {
   using stop_callback_t = stop_callback_for_t<Rec, cancel_keyclick>;
+
+  // complete() and cancel() are called by whoever took the operation out
+  // of pending_completion_. the state settles which of start() and the
+  // caller delivers the result: if start() is still registering the stop
+  // callback, it will; otherwise the caller does.
+  enum class state { idle, waiting, completing, cancelled };
+
   Rec rec_;
   std::optional<stop_callback_t> on_stop_{};
+  std::atomic<state> state_{state::idle};
+  char ch_{};
 
   explicit keyclick_operation(Rec rec) : rec_(std::move(rec)) {}
 
   void complete(char ch) override final {
-    unifex::set_value(std::move(rec_), ch);
+    ch_ = ch;
+    settle(state::completing);
   }
 
   void cancel() override final {
-    unifex::set_done(std::move(rec_));
+    settle(state::cancelled);
+  }
+
+  void settle(state result) noexcept {
+    auto expected = state::idle;
+    if (!state_.compare_exchange_strong(expected, result)) {
+      // start() has finished
+      finish(result);
+    }
+  }
+
+  void finish(state result) noexcept {
+    on_stop_.reset();
+    if (result == state::completing)
+      unifex::set_value(std::move(rec_), ch_);
+    else
+      unifex::set_done(std::move(rec_));
   }
 
   void start() noexcept {
-    // Register the stop callback
-    on_stop_.emplace(unifex::get_stop_token(rec_), cancel_keyclick{});
     // Enqueue the operation
     auto* previous = pending_completion_.exchange(this);
-    /// NB: There is a race condition between the above two
-    /// lines in which a stop request can get dropped. See
-    /// the kbrdhook example for one possible solution.
     assert(previous == nullptr);
+    // Register the stop callback
+    on_stop_.emplace(unifex::get_stop_token(rec_), cancel_keyclick{this});
+    auto expected = state::idle;
+    if (!state_.compare_exchange_strong(expected, state::waiting)) {
+      // a keyclick or a stop request arrived while starting
+      finish(expected);
+    }
   }
 };
 
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <unifex/done_as_optional.hpp>
+#include <unifex/sync_wait.hpp>
+#include <unifex/task.hpp>
+
+#include <cstdio>
+#include <thread>
+
+#include "console_input.hpp"
+#include "event_channel.hpp"
+
+static constexpr char CTRL_C = (char)0x03;
+
+// Unlike the single pending_completion_ slot in the other examples, any
+// number of read_keyclick() senders may wait at once.
+event_channel<char> keyclicks_;
+
+static void on_keyclick(char ch) {
+  if (ch == CTRL_C)
+    keyclicks_.close();
+  else
+    keyclicks_.send_all(ch);
+}
+
+auto read_keyclick() {
+  return keyclicks_.receive();
+}
+
+unifex::task<void> echo_keyclicks(int id) {
+  for (;;) {
+    std::optional<char> ch =
+      co_await unifex::done_as_optional(read_keyclick());
+
+    if (ch) {
+      printf("Task %d read a character! %c\n", id, *ch);
+    } else {
+      printf("Task %d interrupted!\n", id);
+      break;
+    }
+  }
+}
+
+int main() {
+  register_keyboard_callback(on_keyclick);
+
+  // every task, each on its own thread, sees every keyclick
+  std::thread second([] { (void) unifex::sync_wait(echo_keyclicks(2)); });
+  (void) unifex::sync_wait(echo_keyclicks(1));
+  second.join();
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+// the alignment that keeps a field written by one thread off the cache line
+// of fields used by other threads.
+//
+//   alignas(cache_line_size) std::atomic<std::size_t> head_{0};
+//
+// 64 bytes on x64 and arm64 where the library does not say. gcc warns
+// that its value may change with -mtune, so it is not used there.
+#if defined(__cpp_lib_hardware_interference_size) && !defined(__GNUC__)
+inline constexpr std::size_t cache_line_size =
+    std::hardware_destructive_interference_size;
+#else
+inline constexpr std::size_t cache_line_size = 64;
+#endif
@@ -23,7 +23,11 @@
 #include <unifex/sender_concepts.hpp>
 #include <unifex/sequence.hpp>
 
+#include "cache_line.hpp"
 #include "com_thread.hpp"
+#include "latency_trace.hpp"
+#include "memory_budget.hpp"
+#include "stop_event.hpp"
 
 #include <windows.h>
 #include <windowsx.h>
@@ -34,7 +38,9 @@
 struct clean_stop {
   using scheduler_t = decltype(std::declval<com_thread>().get_scheduler());
 
-  static inline std::atomic<unifex::inplace_stop_source*> stop_{nullptr};
+  // read by the console control handler thread
+  alignas(cache_line_size) static inline std::atomic<
+      unifex::inplace_stop_source*> stop_{nullptr};
 
   scheduler_t uiLoop_;
   unifex::inplace_stop_source stopSource_;
@@ -61,33 +67,17 @@ struct clean_stop {
           }
         }));
   }
-  struct make_event {
-    clean_stop* self_;
-
-    template <
-        template <typename...>
-        class Variant,
-        template <typename...>
-        class Tuple>
-    using value_types = Variant<Tuple<>>;
-    template <template <typename...> class Variant>
-    using error_types = Variant<>;
-    static inline constexpr bool sends_done = false;
-    template <typename Receiver>
-    auto operator()(Receiver& rec) noexcept {
-      auto exit = [&rec]() noexcept {
-        unifex::set_value(rec);
-      };
-      return unifex::inplace_stop_callback<decltype(exit)>{
-          self_->stopSource_.get_token(), exit};
-    }
-  };
-  [[nodiscard]] auto event() { return unifex::create(make_event{this}); }
+  [[nodiscard]] auto event() { return stop_event(stopSource_); }
 
   static BOOL WINAPI consoleHandler(DWORD signal) {
     if (signal == CTRL_C_EVENT) {
       printf("\n");  // end the line of '.'
       stop_.load()->request_stop();
+    } else if (signal == CTRL_BREAK_EVENT) {
+      // latency and memory so far, keep running
+      printf("\n");
+      latency_trace::instance().print_summary();
+      memory_budget::instance().print_summary();
     }
     return TRUE;
   }
@@ -0,0 +1,268 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "click_sample.hpp"
+#include "memory_budget.hpp"
+
+#include <unifex/scope_guard.hpp>
+
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mfreadwrite.h>
+#pragma comment(lib, "mfplat.lib")
+#pragma comment(lib, "mfreadwrite.lib")
+#pragma comment(lib, "mfuuid.lib")
+#include <Shlwapi.h>
+#pragma comment(lib, "shlwapi.lib")
+
+#include <cstring>
+#include <utility>
+
+HRESULT click_sample::load_file(PCWSTR path, const WAVEFORMATEX* format) {
+  HRESULT hr = startup();
+  if (FAILED(hr)) {
+    return hr;
+  }
+
+  IMFSourceReader* pReader = nullptr;
+  hr = MFCreateSourceReaderFromURL(path, NULL, &pReader);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  unifex::scope_guard release{[&]() noexcept { pReader->Release(); }};
+  return decode(pReader, format);
+}
+
+HRESULT click_sample::load_resource(
+    HMODULE module,
+    LPCWSTR name,
+    LPCWSTR type,
+    const WAVEFORMATEX* format) {
+  HRSRC resource = FindResourceW(module, name, type);
+  if (!resource) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+  HGLOBAL data = LoadResource(module, resource);
+  if (!data) {
+    return HRESULT_FROM_WIN32(GetLastError());
+  }
+  auto* bytes = static_cast<const BYTE*>(LockResource(data));
+  DWORD size = SizeofResource(module, resource);
+
+  HRESULT hr = startup();
+  if (FAILED(hr)) {
+    return hr;
+  }
+
+  IStream* pStream = SHCreateMemStream(bytes, size);
+  if (!pStream) {
+    return E_OUTOFMEMORY;
+  }
+  unifex::scope_guard releaseStream{[&]() noexcept { pStream->Release(); }};
+
+  IMFByteStream* pByteStream = nullptr;
+  hr = MFCreateMFByteStreamOnStream(pStream, &pByteStream);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  unifex::scope_guard releaseByteStream{
+      [&]() noexcept { pByteStream->Release(); }};
+
+  IMFSourceReader* pReader = nullptr;
+  hr = MFCreateSourceReaderFromByteStream(pByteStream, NULL, &pReader);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  unifex::scope_guard releaseReader{[&]() noexcept { pReader->Release(); }};
+  return decode(pReader, format);
+}
+
+HRESULT click_sample::open_stream(IMFByteStream** ppByteStream) const {
+  IStream* pStream = nullptr;
+  // the stream size is the allocation size, which may be rounded up past
+  // imageBytes_. the riff header has the real size.
+  HRESULT hr = CreateStreamOnHGlobal(wave_, FALSE, &pStream);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  hr = MFCreateMFByteStreamOnStream(pStream, ppByteStream);
+  pStream->Release();
+  return hr;
+}
+
+void click_sample::reset() {
+  if (!!wave_) {
+    GlobalUnlock(wave_);
+    GlobalFree(std::exchange(wave_, (HGLOBAL)NULL));
+    memory_budget::instance().release(memory_budget::voices, imageBytes_);
+    imageBytes_ = 0;
+    format_ = nullptr;
+    pcm_ = nullptr;
+    pcmBytes_ = 0;
+  }
+  if (std::exchange(mfStarted_, false)) {
+    MFShutdown();
+  }
+}
+
+HRESULT click_sample::startup() {
+  if (mfStarted_) {
+    return S_OK;
+  }
+  HRESULT hr = MFStartup(MF_VERSION, MFSTARTUP_LITE);
+  mfStarted_ = SUCCEEDED(hr);
+  return hr;
+}
+
+HRESULT click_sample::decode(
+    IMFSourceReader* pReader, const WAVEFORMATEX* format) {
+  const DWORD stream = (DWORD)MF_SOURCE_READER_FIRST_AUDIO_STREAM;
+
+  HRESULT hr =
+      pReader->SetStreamSelection((DWORD)MF_SOURCE_READER_ALL_STREAMS, FALSE);
+  if (SUCCEEDED(hr)) {
+    hr = pReader->SetStreamSelection(stream, TRUE);
+  }
+  if (FAILED(hr)) {
+    return hr;
+  }
+
+  // ask the reader to decode to PCM (or to the requested format)
+  IMFMediaType* pPartialType = nullptr;
+  hr = MFCreateMediaType(&pPartialType);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  if (!!format) {
+    hr = MFInitMediaTypeFromWaveFormatEx(
+        pPartialType, format, sizeof(WAVEFORMATEX) + format->cbSize);
+  } else {
+    hr = pPartialType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Audio);
+    if (SUCCEEDED(hr)) {
+      hr = pPartialType->SetGUID(MF_MT_SUBTYPE, MFAudioFormat_PCM);
+    }
+  }
+  if (SUCCEEDED(hr)) {
+    hr = pReader->SetCurrentMediaType(stream, NULL, pPartialType);
+  }
+  pPartialType->Release();
+  if (FAILED(hr)) {
+    return hr;
+  }
+
+  IMFMediaType* pType = nullptr;
+  hr = pReader->GetCurrentMediaType(stream, &pType);
+  if (FAILED(hr)) {
+    return hr;
+  }
+  WAVEFORMATEX* pFormat = nullptr;
+  UINT32 formatBytes = 0;
+  hr = MFCreateWaveFormatExFromMFMediaType(pType, &pFormat, &formatBytes);
+  pType->Release();
+  if (FAILED(hr)) {
+    return hr;
+  }
+  unifex::scope_guard freeFormat{[&]() noexcept { CoTaskMemFree(pFormat); }};
+
+  std::vector<BYTE> pcm;
+  for (;;) {
+    DWORD flags = 0;
+    IMFSample* pSample = nullptr;
+    hr = pReader->ReadSample(stream, 0, NULL, &flags, NULL, &pSample);
+    if (FAILED(hr)) {
+      return hr;
+    }
+    if (flags & MF_SOURCE_READERF_ENDOFSTREAM) {
+      if (!!pSample) {
+        pSample->Release();
+      }
+      break;
+    }
+    if (!pSample) {
+      continue;
+    }
+    IMFMediaBuffer* pBuffer = nullptr;
+    hr = pSample->ConvertToContiguousBuffer(&pBuffer);
+    pSample->Release();
+    if (FAILED(hr)) {
+      return hr;
+    }
+    BYTE* data = nullptr;
+    DWORD length = 0;
+    hr = pBuffer->Lock(&data, NULL, &length);
+    if (SUCCEEDED(hr)) {
+      pcm.insert(pcm.end(), data, data + length);
+      pBuffer->Unlock();
+    }
+    pBuffer->Release();
+    if (FAILED(hr)) {
+      return hr;
+    }
+  }
+
+  return build_image(*pFormat, formatBytes, pcm);
+}
+
+HRESULT click_sample::build_image(
+    const WAVEFORMATEX& format,
+    UINT32 formatBytes,
+    const std::vector<BYTE>& pcm) {
+  auto put32 = [](BYTE*& out, DWORD value) {
+    std::memcpy(out, &value, sizeof(value));
+    out += sizeof(value);
+  };
+  auto putTag = [](BYTE*& out, const char (&tag)[5]) {
+    std::memcpy(out, tag, 4);
+    out += 4;
+  };
+
+  const DWORD pcmBytes = (DWORD)pcm.size();
+  const DWORD imageBytes = 12 + (8 + formatBytes) + (8 + pcmBytes);
+  auto& budget = memory_budget::instance();
+  if (!budget.try_reserve(memory_budget::voices, imageBytes)) {
+    // the decoded sample does not fit under the cap
+    return E_OUTOFMEMORY;
+  }
+  HGLOBAL wave = GlobalAlloc(GMEM_MOVEABLE, imageBytes);
+  if (!wave) {
+    budget.release(memory_budget::voices, imageBytes);
+    return E_OUTOFMEMORY;
+  }
+  auto* image = static_cast<BYTE*>(GlobalLock(wave));
+  BYTE* out = image;
+  putTag(out, "RIFF");
+  put32(out, imageBytes - 8);
+  putTag(out, "WAVE");
+  putTag(out, "fmt ");
+  put32(out, formatBytes);
+  std::memcpy(out, &format, formatBytes);
+  out += formatBytes;
+  putTag(out, "data");
+  put32(out, pcmBytes);
+  std::memcpy(out, pcm.data(), pcmBytes);
+
+  if (!!wave_) {
+    GlobalUnlock(wave_);
+    GlobalFree(wave_);
+    budget.release(memory_budget::voices, imageBytes_);
+  }
+  wave_ = wave;
+  imageBytes_ = imageBytes;
+  format_ = reinterpret_cast<const WAVEFORMATEX*>(image + 12 + 8);
+  pcm_ = out;
+  pcmBytes_ = pcmBytes;
+  return S_OK;
+}
@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <windows.h>
+#include <mfobjects.h>
+#include <mmreg.h>
+
+#include <vector>
+
+struct IMFSourceReader;
+
+// the click sound, decoded once to PCM and kept in memory as a RIFF/WAVE
+// image. voices open their own read-only stream over the shared image. the
+// image is charged to memory_budget::voices.
+struct click_sample {
+  ~click_sample() { reset(); }
+  click_sample()
+    : mfStarted_(false)
+    , wave_(NULL)
+    , imageBytes_(0)
+    , format_(nullptr)
+    , pcm_(nullptr)
+    , pcmBytes_(0) {}
+  click_sample(const click_sample&) = delete;
+
+  bool loaded() const { return !!wave_; }
+
+  // decode a local file (or any url the source reader supports). when format
+  // is set the reader converts to it, otherwise to the native pcm format.
+  HRESULT load_file(PCWSTR path, const WAVEFORMATEX* format = nullptr);
+
+  // decode an encoded (e.g. mp3) resource embedded in module
+  HRESULT load_resource(
+      HMODULE module,
+      LPCWSTR name,
+      LPCWSTR type,
+      const WAVEFORMATEX* format = nullptr);
+
+  // a new stream over the shared wave image, with its own seek pointer
+  HRESULT open_stream(IMFByteStream** ppByteStream) const;
+
+  const WAVEFORMATEX& format() const { return *format_; }
+  const BYTE* pcm() const { return pcm_; }
+  DWORD pcm_bytes() const { return pcmBytes_; }
+
+  void reset();
+
+private:
+  // media foundation stays started while the sample is loaded, voices
+  // create byte streams from it
+  HRESULT startup();
+
+  HRESULT decode(IMFSourceReader* pReader, const WAVEFORMATEX* format);
+
+  HRESULT build_image(
+      const WAVEFORMATEX& format,
+      UINT32 formatBytes,
+      const std::vector<BYTE>& pcm);
+
+  bool mfStarted_;
+  // the wave image stays locked (and so does not move) while loaded
+  HGLOBAL wave_;
+  DWORD imageBytes_;
+  const WAVEFORMATEX* format_;
+  const BYTE* pcm_;
+  DWORD pcmBytes_;
+};
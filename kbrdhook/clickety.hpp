@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/coroutine.hpp>
+#include <unifex/done_as_optional.hpp>
+
+#include "frame_pool.hpp"
+#include "latency_trace.hpp"
+
+#include <memory>
+#include <utility>
+
+// one click per key press until the events run out.
+//
+// ClickPlayer is Player, WasapiPlayer or anything with Click(stamp_t).
+// Keyboard is keyboard_hook or anything with event_batches<N>() of
+// key_events, e.g. a range over a synthetic_source. releases are skipped.
+// the coroutine frame comes from frames, the awaits inside the loop keep
+// their state in the frame, so a keystroke does not allocate.
+template <typename ClickPlayer, typename Keyboard>
+pooled_task<void> clickety(
+    std::allocator_arg_t,
+    frame_pool& frames,
+    ClickPlayer& player,
+    Keyboard& keyboard) {
+  for (auto next : keyboard.template event_batches<16>()) {
+    auto batch = co_await unifex::done_as_optional(std::move(next));
+    if (!batch) {
+      break;
+    }
+    for (auto&& evt : *batch) {
+      if (!evt.down()) {
+        continue;
+      }
+      latency_trace::mark(latency_trace::resume, evt.hookTime_);
+      player.Click(evt.hookTime_);
+    }
+  }
+
+  co_return;
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "com_thread.hpp"
+
+#include <unifex/scope_guard.hpp>
+
+#include <windowsx.h>
+#include <winuser.h>
+
+#include <cstdio>
+
+com_thread::~com_thread() {
+  join();
+  CloseHandle(exited_);
+}
+
+com_thread::com_thread(DWORD joinTimeoutMs)
+  : joinTimeoutMs_(joinTimeoutMs)
+  , exited_(_create_exit_event())
+  , comThread_([this]() noexcept { _run(); }) {}
+
+HANDLE com_thread::_create_exit_event() noexcept {
+  // manual reset, so join() can be called more than once
+  HANDLE event = CreateEventW(NULL, TRUE, FALSE, NULL);
+  if (!event) {
+    std::terminate();
+  }
+  return event;
+}
+
+void com_thread::_run() noexcept {
+  {  // create message queue
+    MSG msg;
+    PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);
+  }
+  printf("com thread start\n");
+  fflush(stdout);
+
+  if (FAILED(CoInitializeEx(
+          nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE))) {
+    std::terminate();
+  }
+
+  unifex::scope_guard exit{[this]() noexcept {
+    // run until empty
+    while (_drain()) {
+    }
+
+    CoUninitialize();
+
+    auto wakeups = stats();
+    printf(
+        "com thread exit (wakeups: %zu posted, %zu coalesced, %zu "
+        "retried)\n",
+        wakeups.posted_,
+        wakeups.coalesced_,
+        wakeups.retried_);
+    fflush(stdout);
+
+    SetEvent(exited_);
+  }};
+
+  BOOL pendingMessages = FALSE;
+  MSG msg = {};
+  // the first schedule() after a drain posts a message, so GetMessage is
+  // the only wait. queued work runs after each message without a timer
+  // round-trip.
+  while ((pendingMessages = GetMessage(&msg, NULL, 0, 0)) != 0) {
+    if (pendingMessages == -1) {
+      std::terminate();
+    }
+    TranslateMessage(&msg);
+    DispatchMessage(&msg);
+    (void)_drain();
+  }
+}
+
+bool com_thread::_drain() noexcept {
+  // the next _post() must wake the loop again. acq_rel pairs with the
+  // exchange in _post() so that work enqueued before a coalesced wakeup
+  // is seen by the dequeue below.
+  (void)wakeupPending_.exchange(false, std::memory_order_acq_rel);
+  auto work = queue_.dequeue_all();
+  if (work.empty()) {
+    return false;
+  }
+  while (!work.empty()) {
+    auto* item = work.pop_front();
+    item->execute_(item);
+  }
+  return true;
+}
+
+void com_thread::_post(queued_work* work) noexcept {
+  (void)queue_.enqueue(work);
+  if (wakeupPending_.exchange(true, std::memory_order_acq_rel)) {
+    // the loop has not drained since the last wakeup, it will see this
+    coalescedWakeups_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  // wake up the message loop
+  if (_post_message(WM_USER)) {
+    postedWakeups_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool com_thread::_post_message(UINT message) noexcept {
+  if (!comThread_.joinable()) {
+    return false;
+  }
+  const DWORD threadId = GetThreadId(comThread_.native_handle());
+  constexpr int maxAttempts = 10;
+  for (int attempt = 0; attempt < maxAttempts; ++attempt) {
+    if (PostThreadMessageW(threadId, message, 0, 0L)) {
+      return true;
+    }
+    retriedWakeups_.fetch_add(1, std::memory_order_relaxed);
+    if (attempt < 3) {
+      std::this_thread::yield();
+    } else {
+      // 1, 2, 4, .. 64ms
+      Sleep(DWORD{1} << (attempt - 3));
+    }
+  }
+  // the com thread is not pumping messages
+  std::terminate();
+}
+
+com_thread::wakeup_stats com_thread::stats() const noexcept {
+  return {
+      postedWakeups_.load(std::memory_order_relaxed),
+      coalescedWakeups_.load(std::memory_order_relaxed),
+      retriedWakeups_.load(std::memory_order_relaxed)};
+}
+
+void com_thread::join() {
+  if (comThread_.joinable()) {
+    if (!_post_message(WM_QUIT)) {
+      std::terminate();
+    }
+    // the com thread signals once it has drained the queue and
+    // uninitialized COM, so the wait is only as long as the work left.
+    if (WaitForSingleObject(exited_, joinTimeoutMs_) != WAIT_OBJECT_0) {
+      printf("com thread did not exit within %lums\n", joinTimeoutMs_);
+      fflush(stdout);
+      std::terminate();
+    }
+    try {
+      comThread_.join();
+    } catch (...) {
+    }
+  }
+}
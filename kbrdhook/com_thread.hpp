@@ -16,79 +16,73 @@
 
 #pragma once
 
-#include <unifex/just.hpp>
-#include <unifex/let_done.hpp>
-#include <unifex/manual_event_loop.hpp>
-#include <unifex/repeat_effect_until.hpp>
+#include <unifex/detail/atomic_intrusive_queue.hpp>
+
+#include <unifex/create.hpp>
+#include <unifex/receiver_concepts.hpp>
 #include <unifex/scheduler_concepts.hpp>
 #include <unifex/sender_concepts.hpp>
-#include <unifex/stop_when.hpp>
-#include <unifex/sync_wait.hpp>
-#include <unifex/timed_single_thread_context.hpp>
 
-#include <chrono>
+#include <atomic>
+#include <cstddef>
+#include <exception>
 #include <thread>
 
 #include <windows.h>
-#include <windowsx.h>
-#include <winuser.h>
 
+// the thread that pumps messages for the keyboard hook and owns the single
+// threaded COM objects. Windows removes a low-level hook that does not
+// return within LowLevelHooksTimeout, so only work that needs this thread
+// runs here; work that may block or take long goes to an iocp_context.
 struct com_thread {
-  using run_scheduler_t =
-      decltype(std::declval<unifex::manual_event_loop&>().get_scheduler());
-  using time_scheduler_t =
-      decltype(std::declval<unifex::timed_single_thread_context>()
-                   .get_scheduler());
-  using duration_t =
-      typename unifex::timed_single_thread_context::clock_t::duration;
-  duration_t maxTime_;
-  unifex::timed_single_thread_context time_;
-  unifex::manual_event_loop run_;
+  // an item of work scheduled onto the com thread
+  struct queued_work {
+    void (*execute_)(queued_work*) noexcept;
+    queued_work* next_{nullptr};
+  };
+
+  struct wakeup_stats {
+    // WM_USER messages posted to the com thread
+    std::size_t posted_;
+    // schedules that found a wakeup already pending
+    std::size_t coalesced_;
+    // failed PostThreadMessageW calls that were retried
+    std::size_t retried_;
+  };
+
+  unifex::atomic_intrusive_queue<queued_work, &queued_work::next_> queue_;
+  // set by the first _post() after a _drain()
+  std::atomic<bool> wakeupPending_{false};
+  std::atomic<std::size_t> postedWakeups_{0};
+  std::atomic<std::size_t> coalescedWakeups_{0};
+  std::atomic<std::size_t> retriedWakeups_{0};
+  // how long join() waits for the com thread to finish its work
+  DWORD joinTimeoutMs_;
+  // signaled by the com thread after the last work has run and COM is
+  // uninitialized
+  HANDLE exited_;
   std::thread comThread_;
-  ~com_thread() { join(); }
-  com_thread() = delete;
-  explicit com_thread(duration_t maxTime)
-    : maxTime_(maxTime)
-    , comThread_([this]() noexcept {
-      {  // create message queue
-        MSG msg;
-        PeekMessage(&msg, NULL, WM_USER, WM_USER, PM_NOREMOVE);
-      }
-      printf("com thread start\n");
-      fflush(stdout);
-
-      if (FAILED(CoInitializeEx(
-              nullptr, COINIT_APARTMENTTHREADED | COINIT_DISABLE_OLE1DDE))) {
-        std::terminate();
-      }
-
-      unifex::scope_guard exit{[this]() noexcept {
-        run_.stop();
-        run_.run();  // run until empty
-
-        CoUninitialize();
-
-        printf("com thread exit\n");
-        fflush(stdout);
-      }};
-
-      BOOL pendingMessages = FALSE;
-      MSG msg = {};
-      while ((pendingMessages = GetMessage(&msg, NULL, 0, 0)) != 0) {
-        if (pendingMessages == -1) {
-          std::terminate();
-        }
-        TranslateMessage(&msg);
-        DispatchMessage(&msg);
-        unifex::sync_wait(
-            run_.run_as_sender() |
-            unifex::stop_when(
-                unifex::schedule_after(time_.get_scheduler(), maxTime_)));
-      }
-    }) {}
+  ~com_thread();
+  explicit com_thread(DWORD joinTimeoutMs = 5000);
+
+  static HANDLE _create_exit_event() noexcept;
+
+  // the message loop, until WM_QUIT
+  void _run() noexcept;
+
+  // runs the work that is queued now. work queued while this runs is left
+  // for the next call. returns false when there was nothing to run.
+  bool _drain() noexcept;
+
+  void _post(queued_work* work) noexcept;
+
+  // posting fails while the message queue is being created or when it is
+  // full, so retry with a bounded backoff.
+  bool _post_message(UINT message) noexcept;
+
+  wakeup_stats stats() const noexcept;
+
   struct make_sender {
-    using sender_t =
-        decltype(unifex::schedule(std::declval<run_scheduler_t&>()));
     com_thread* self_;
     explicit make_sender(com_thread* self) : self_(self) {}
     template <
@@ -96,36 +90,30 @@ struct com_thread {
         class Variant,
         template <typename...>
         class Tuple>
-    using value_types = unifex::sender_value_types_t<sender_t, Variant, Tuple>;
+    using value_types = Variant<Tuple<>>;
     template <template <typename...> class Variant>
-    using error_types = unifex::sender_error_types_t<sender_t, Variant>;
-    static inline constexpr bool sends_done = sender_t::sends_done;
+    using error_types = Variant<>;
+    static inline constexpr bool sends_done = false;
 
     template <typename Receiver>
     auto operator()(Receiver& rec) noexcept {
-      struct state {
-        using op_t = unifex::connect_result_t<sender_t, Receiver&>;
-        com_thread* self_;
-        op_t op_;
-        state(com_thread* self, sender_t sender, Receiver rec)
-          : self_(self)
-          , op_(unifex::connect(std::move(sender), rec)) {
-          unifex::start(op_);
-          // wake up the message loop
-          while (self_->comThread_.joinable() &&
-                 !PostThreadMessageW(
-                     GetThreadId(self_->comThread_.native_handle()),
-                     WM_USER,
-                     0,
-                     0L)) {
-          }
+      struct state : queued_work {
+        Receiver& rec_;
+        static void _execute(queued_work* work) noexcept {
+          auto& self = *static_cast<state*>(work);
+          unifex::set_value(std::move(self.rec_));
+        }
+        state(com_thread* self, Receiver& rec)
+          : queued_work{&_execute}
+          , rec_(rec) {
+          self->_post(this);
         }
         state() = delete;
         state(const state&) = delete;
         state(state&&) = delete;
       };
 
-      return state{self_, unifex::schedule(self_->run_.get_scheduler()), rec};
+      return state{self_, rec};
     }
   };
   struct _scheduler {
@@ -135,34 +123,17 @@ struct com_thread {
     _scheduler(const _scheduler&) = default;
     _scheduler(_scheduler&&) = default;
 
-    auto schedule() {
-      // return unifex::schedule(self_->run_.get_scheduler());
-      return unifex::create(make_sender{self_});
-    }
+    auto schedule() { return unifex::create(make_sender{self_}); }
 
     friend bool operator==(_scheduler a, _scheduler b) noexcept {
-      return a.self_->run_.get_scheduler() == b.self_->run_.get_scheduler();
+      return a.self_ == b.self_;
     }
     friend bool operator!=(_scheduler a, _scheduler b) noexcept {
-      return a.self_->run_.get_scheduler() != b.self_->run_.get_scheduler();
+      return a.self_ != b.self_;
     }
   };
   _scheduler get_scheduler() { return _scheduler{this}; }
 
-  void join() {
-    if (comThread_.joinable()) {
-      if (!PostThreadMessageW(
-              GetThreadId(comThread_.native_handle()), WM_QUIT, 0, 0L)) {
-        std::terminate();
-      }
-      try {
-        // there is a race in the windows thread implementation :(
-        std::this_thread::sleep_for(std::chrono::milliseconds(500));
-        if (comThread_.joinable()) {
-          comThread_.join();
-        }
-      } catch (...) {
-      }
-    }
-  }
+  // waits for the queued work to run and the thread to exit
+  void join();
 };
\ No newline at end of file
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/sender_concepts.hpp>
+#include <unifex/sequence.hpp>
+#include <unifex/when_all.hpp>
+
+#include <tuple>
+#include <type_traits>
+
+// startup and shutdown of components that have start() and destroy()
+// senders (clean_stop, keyboard_hook, Player, WasapiPlayer).
+//
+// together(a, b) starts a and b concurrently and destroys them
+// concurrently, so starting takes as long as the slower of the two.
+// after(a, b) is for b that needs a: a starts before b, and b is destroyed
+// before a. the results are components themselves and nest:
+//
+//   // the keyboard and the player load at the same time, both after exit
+//   auto app = after(exit, together(player, keyboard));
+//   sync_wait(sequence(app.start(), run, app.destroy()));
+//
+// the components are held by reference and must outlive the result.
+struct component_group_base {};
+
+namespace detail {
+// groups are held by value, components by reference
+template <typename Component>
+using _component_ref_t = std::conditional_t<
+    std::is_base_of_v<component_group_base, std::remove_cvref_t<Component>>,
+    std::remove_cvref_t<Component>,
+    Component&>;
+}  // namespace detail
+
+template <typename... Components>
+struct together_t : component_group_base {
+  std::tuple<detail::_component_ref_t<Components>...> components_;
+
+  [[nodiscard]] auto start() {
+    return std::apply(
+        [](auto&... c) { return unifex::when_all(c.start()...); },
+        components_);
+  }
+  [[nodiscard]] auto destroy() {
+    return std::apply(
+        [](auto&... c) { return unifex::when_all(c.destroy()...); },
+        components_);
+  }
+};
+
+template <typename First, typename Then>
+struct after_t : component_group_base {
+  detail::_component_ref_t<First> first_;
+  detail::_component_ref_t<Then> then_;
+
+  [[nodiscard]] auto start() {
+    return unifex::sequence(first_.start(), then_.start());
+  }
+  [[nodiscard]] auto destroy() {
+    return unifex::sequence(then_.destroy(), first_.destroy());
+  }
+};
+
+template <typename... Components>
+together_t<Components...> together(Components&&... components) {
+  return {{}, {(Components &&) components...}};
+}
+
+template <typename First, typename Then>
+after_t<First, Then> after(First&& first, Then&& then) {
+  return {{}, (First &&) first, (Then &&) then};
+}
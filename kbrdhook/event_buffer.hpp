@@ -0,0 +1,283 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <optional>
+#include <span>
+#include <type_traits>
+
+#include "cache_line.hpp"
+
+// what to do with an event that arrives while the buffer is full
+enum class overflow_policy {
+  // evict the oldest buffered event to make room for the new one
+  drop_oldest,
+  // discard the new event
+  drop_newest,
+  // overwrite the newest buffered event with the new one
+  coalesce
+};
+
+// fixed-capacity ring of events with a single producer.
+//
+// the producer is the thread that dispatches events. the read index is
+// claimed with a CAS, so a consumer may race with the producer evicting the
+// oldest event or coalescing into the newest. each slot is a seqlock: the
+// event is kept in words that are each lock-free, whatever its size, and a
+// read that raced with a write of the slot fails its sequence check and is
+// retried rather than delivered torn.
+template <typename EventType, std::size_t Capacity, overflow_policy Overflow>
+struct event_buffer {
+  static_assert(Capacity >= 2, "event_buffer needs room for two events");
+  static_assert(
+      std::is_trivially_copyable_v<EventType> &&
+          std::is_default_constructible_v<EventType>,
+      "buffered events must be trivially copyable and default constructible");
+  static_assert(
+      std::atomic<std::size_t>::is_always_lock_free,
+      "event_buffer indices and slot words must be lock-free");
+
+  static inline constexpr bool enabled = true;
+
+  // producer only
+  void push(const EventType& event) noexcept {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    auto head = head_.load(std::memory_order_acquire);
+    if (tail - head >= Capacity) {
+      if constexpr (Overflow == overflow_policy::drop_newest) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+      } else if constexpr (Overflow == overflow_policy::coalesce) {
+        _write(slots_[(tail - 1) % Capacity], event);
+        if (head_.load(std::memory_order_acquire) < tail) {
+          // the newest event was still buffered. (best-effort: a consumer
+          // that read the slot just before the store delivers the old value)
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+          return;
+        }
+        // the consumer drained past the newest event, append instead.
+      } else {
+        // a failed CAS means a consumer took the oldest event, which also
+        // makes room
+        if (head_.compare_exchange_strong(
+                head, head + 1, std::memory_order_acq_rel)) {
+          dropped_.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    }
+    _write(slots_[tail % Capacity], event);
+    tail_.store(tail + 1, std::memory_order_release);
+  }
+
+  std::optional<EventType> try_pop() noexcept {
+    auto head = head_.load(std::memory_order_acquire);
+    while (head != tail_.load(std::memory_order_acquire)) {
+      EventType event;
+      if (!_read(slots_[head % Capacity], event)) {
+        // the producer is writing the slot, look again
+        head = head_.load(std::memory_order_acquire);
+        continue;
+      }
+      // a slot is only rewritten for a later position once head_ has moved
+      // past it, so the claim fails for an event that was overwritten
+      if (head_.compare_exchange_weak(
+              head,
+              head + 1,
+              std::memory_order_acq_rel,
+              std::memory_order_acquire)) {
+        return event;
+      }
+    }
+    return std::nullopt;
+  }
+
+  bool empty() const noexcept {
+    return head_.load(std::memory_order_acquire) ==
+        tail_.load(std::memory_order_acquire);
+  }
+
+  // number of events lost to the overflow policy
+  std::size_t dropped() const noexcept {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+private:
+  using word_t = std::size_t;
+  static inline constexpr std::size_t words =
+      (sizeof(EventType) + sizeof(word_t) - 1) / sizeof(word_t);
+
+  struct slot {
+    // odd while the producer writes the words
+    std::atomic<std::size_t> seq_{0};
+    std::array<std::atomic<word_t>, words> words_{};
+  };
+
+  // producer only
+  static void _write(slot& s, const EventType& event) noexcept {
+    std::array<word_t, words> data{};
+    std::memcpy(data.data(), &event, sizeof(EventType));
+    const auto seq = s.seq_.load(std::memory_order_relaxed);
+    s.seq_.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (std::size_t i = 0; i != words; ++i) {
+      s.words_[i].store(data[i], std::memory_order_relaxed);
+    }
+    s.seq_.store(seq + 2, std::memory_order_release);
+  }
+
+  // false when the read raced with a write of the slot
+  static bool _read(const slot& s, EventType& event) noexcept {
+    const auto seq = s.seq_.load(std::memory_order_acquire);
+    if ((seq & 1) != 0) {
+      return false;
+    }
+    std::array<word_t, words> data;
+    for (std::size_t i = 0; i != words; ++i) {
+      data[i] = s.words_[i].load(std::memory_order_relaxed);
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s.seq_.load(std::memory_order_relaxed) != seq) {
+      return false;
+    }
+    std::memcpy(&event, data.data(), sizeof(EventType));
+    return true;
+  }
+
+  std::array<slot, Capacity> slots_{};
+  // claimed by the consumers (and by the producer evicting)
+  alignas(cache_line_size) std::atomic<std::size_t> head_{0};
+  // producer only
+  alignas(cache_line_size) std::atomic<std::size_t> tail_{0};
+  std::atomic<std::size_t> dropped_{0};
+};
+
+// fixed-capacity ring with one producer and one consumer, for handing
+// events from a thread that must not wait (a hook procedure) to one that
+// may. a push into a full ring drops the event and counts it.
+template <typename EventType, std::size_t Capacity>
+struct spsc_ring {
+  static_assert(
+      Capacity >= 2 && (Capacity & (Capacity - 1)) == 0,
+      "spsc_ring capacity must be a power of two");
+  static_assert(
+      std::is_trivially_copyable_v<EventType>,
+      "ring events must be trivially copyable");
+
+  // producer only
+  bool push(const EventType& event) noexcept {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == Capacity) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+    slots_[tail & (Capacity - 1)] = event;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer only
+  bool pop(EventType& event) noexcept {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    event = slots_[head & (Capacity - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // consumer only. calls fn with each event in its slot, then frees the
+  // slot. returns the number of events.
+  template <typename Fn>
+  std::size_t consume_all(Fn&& fn) noexcept {
+    auto head = head_.load(std::memory_order_relaxed);
+    const auto tail = tail_.load(std::memory_order_acquire);
+    for (auto next = head; next != tail; ++next) {
+      fn(slots_[next & (Capacity - 1)]);
+      head_.store(next + 1, std::memory_order_release);
+    }
+    return tail - head;
+  }
+
+  bool empty() const noexcept {
+    return head_.load(std::memory_order_acquire) ==
+        tail_.load(std::memory_order_acquire);
+  }
+
+  // number of events pushed into a full ring
+  std::size_t dropped() const noexcept {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::array<EventType, Capacity> slots_{};
+  // consumer only
+  alignas(cache_line_size) std::atomic<std::size_t> head_{0};
+  // producer only
+  alignas(cache_line_size) std::atomic<std::size_t> tail_{0};
+  std::atomic<std::size_t> dropped_{0};
+};
+
+// a fixed-capacity batch of events. delivered by value so that it stays
+// valid after the operation that collected it is destroyed.
+template <typename EventType, std::size_t MaxBatch>
+struct event_batch {
+  static_assert(MaxBatch > 0, "event_batch needs room for one event");
+
+  void push_back(const EventType& event) noexcept {
+    events_[size_++] = event;
+  }
+
+  bool full() const noexcept { return size_ == MaxBatch; }
+  bool empty() const noexcept { return size_ == 0; }
+  std::size_t size() const noexcept { return size_; }
+
+  const EventType* begin() const noexcept { return events_.data(); }
+  const EventType* end() const noexcept { return events_.data() + size_; }
+
+  std::span<const EventType> events() const noexcept {
+    return {events_.data(), size_};
+  }
+
+private:
+  std::array<EventType, MaxBatch> events_{};
+  std::size_t size_{0};
+};
+
+// buffering policies for sender_range
+
+// events that arrive while no sender is pending are discarded
+struct unbuffered {
+  template <typename EventType>
+  struct buffer_type {
+    static inline constexpr bool enabled = false;
+  };
+};
+
+// events that arrive while no sender is pending are kept until the next
+// sender starts
+template <
+    std::size_t Capacity,
+    overflow_policy Overflow = overflow_policy::drop_oldest>
+struct buffered {
+  template <typename EventType>
+  using buffer_type = event_buffer<EventType, Capacity, Overflow>;
+};
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/await_transform.hpp>
+#include <unifex/get_stop_token.hpp>
+#include <unifex/inplace_stop_token.hpp>
+#include <unifex/receiver_concepts.hpp>
+#include <unifex/stop_token_concepts.hpp>
+#include <unifex/tag_invoke.hpp>
+
+#include "memory_budget.hpp"
+
+#include <atomic>
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// recycles coroutine frames. frames up to blockSize bytes come from a free
+// list of preallocated blocks, larger frames (or more of them than there
+// are blocks) go to the heap and are counted.
+//
+// the blocks and the heap frames are charged to memory_budget::frames. a
+// heap frame that would go over its cap throws std::bad_alloc from the call
+// of the coroutine.
+//
+// a pooled_task coroutine takes its frame from the pool given as its first
+// two parameters, std::allocator_arg and a frame_pool&:
+//
+//   template <typename Player>
+//   pooled_task<void> clickety(std::allocator_arg_t, frame_pool&, Player&);
+struct frame_pool {
+  struct frame_stats {
+    // frames handed out from the free list
+    std::size_t pooled_;
+    // frames that had to be allocated from the heap
+    std::size_t heap_;
+  };
+
+  ~frame_pool() {
+    if (outstanding_ != 0) {
+      // a frame outlived its pool
+      std::terminate();
+    }
+  }
+  explicit frame_pool(std::size_t blockSize = 1024, std::size_t blocks = 8)
+    : blockSize_(_round_up(blockSize))
+    , blocks_(blocks)
+    , storage_(new std::byte[blockSize_ * blocks])
+    , outstanding_(0)
+    , charge_(memory_budget::frames, blockSize_ * blocks) {
+    free_.reserve(blocks);
+    for (std::size_t i = 0; i != blocks; ++i) {
+      free_.push_back(storage_.get() + i * blockSize_);
+    }
+  }
+  frame_pool(const frame_pool&) = delete;
+
+  void* allocate(std::size_t size) {
+    const std::size_t total = size + header_size;
+    std::byte* block = nullptr;
+    if (total <= blockSize_) {
+      std::lock_guard lock{lock_};
+      if (!free_.empty()) {
+        block = free_.back();
+        free_.pop_back();
+        ++outstanding_;
+      }
+    }
+    if (!!block) {
+      pooled_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+      if (!memory_budget::instance().try_reserve(
+              memory_budget::frames, total)) {
+        throw std::bad_alloc{};
+      }
+      block = static_cast<std::byte*>(::operator new(total, std::nothrow));
+      if (!block) {
+        memory_budget::instance().release(memory_budget::frames, total);
+        throw std::bad_alloc{};
+      }
+      heap_.fetch_add(1, std::memory_order_relaxed);
+    }
+    // remember the pool, operator delete of the frame is not given it
+    ::new (block) frame_pool*(this);
+    return block + header_size;
+  }
+
+  static void deallocate(void* frame, std::size_t size) noexcept {
+    auto* block = static_cast<std::byte*>(frame) - header_size;
+    auto* self = *std::launder(reinterpret_cast<frame_pool**>(block));
+    auto* storage = self->storage_.get();
+    if (block >= storage &&
+        block < storage + self->blockSize_ * self->blocks_) {
+      std::lock_guard lock{self->lock_};
+      self->free_.push_back(block);
+      --self->outstanding_;
+    } else {
+      ::operator delete(block, size + header_size);
+      memory_budget::instance().release(
+          memory_budget::frames, size + header_size);
+    }
+  }
+
+  frame_stats stats() const noexcept {
+    return {
+        pooled_.load(std::memory_order_relaxed),
+        heap_.load(std::memory_order_relaxed)};
+  }
+
+private:
+  // keeps the frame at the default new alignment
+  static inline constexpr std::size_t header_size =
+      __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+  static std::size_t _round_up(std::size_t size) noexcept {
+    return (size + header_size - 1) / header_size * header_size;
+  }
+
+  const std::size_t blockSize_;
+  const std::size_t blocks_;
+  std::unique_ptr<std::byte[]> storage_;
+  std::mutex lock_;
+  std::vector<std::byte*> free_;
+  std::size_t outstanding_;
+  memory_charge charge_;
+  std::atomic<std::size_t> pooled_{0};
+  std::atomic<std::size_t> heap_{0};
+};
+
+namespace detail {
+template <typename T>
+struct _pooled_result {
+  std::optional<T> value_;
+  template <typename Value>
+  void return_value(Value&& value) {
+    value_.emplace((Value&&)value);
+  }
+};
+template <>
+struct _pooled_result<void> {
+  void return_void() noexcept {}
+};
+}  // namespace detail
+
+// a coroutine like unifex::task<T>, with its frame from a frame_pool. the
+// promise is its own, unifex::task has no hook for the frame allocation.
+//
+// it is a sender that runs the coroutine when started and completes with
+// what it returns, the exception that escaped it or done from a sender it
+// awaited. the senders it awaits get the stop token of its receiver, which
+// must be an inplace_stop_token or one that is never stopped. it is not
+// awaitable from another coroutine.
+template <typename T>
+class pooled_task {
+public:
+  struct promise_type : detail::_pooled_result<T> {
+    template <typename... Args>
+    static void* operator new(
+        std::size_t size, std::allocator_arg_t, frame_pool& pool, Args&...) {
+      return pool.allocate(size);
+    }
+    static void operator delete(void* frame, std::size_t size) noexcept {
+      frame_pool::deallocate(frame, size);
+    }
+
+    pooled_task get_return_object() noexcept {
+      return pooled_task{
+          std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept {
+      struct awaiter : std::suspend_always {
+        void await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+          // may destroy the frame
+          auto& p = h.promise();
+          p.complete_(p.op_, p);
+        }
+      };
+      return awaiter{};
+    }
+    void unhandled_exception() noexcept { error_ = std::current_exception(); }
+    // an awaited sender completed with done, the coroutine is not resumed
+    std::coroutine_handle<> unhandled_done() noexcept {
+      done_ = true;
+      complete_(op_, *this);
+      return std::noop_coroutine();
+    }
+
+    template <typename Value>
+    decltype(auto) await_transform(Value&& value) {
+      return unifex::await_transform(*this, (Value&&)value);
+    }
+
+    friend unifex::inplace_stop_token tag_invoke(
+        unifex::tag_t<unifex::get_stop_token>, const promise_type& p) noexcept {
+      return p.stoken_;
+    }
+
+    // set by the operation of the sender when it starts
+    void (*complete_)(void*, promise_type&) noexcept = nullptr;
+    void* op_ = nullptr;
+    unifex::inplace_stop_token stoken_;
+    std::exception_ptr error_;
+    bool done_ = false;
+  };
+
+  template <
+      template <typename...>
+      class Variant,
+      template <typename...>
+      class Tuple>
+  using value_types =
+      Variant<std::conditional_t<std::is_void_v<T>, Tuple<>, Tuple<T>>>;
+  template <template <typename...> class Variant>
+  using error_types = Variant<std::exception_ptr>;
+  static inline constexpr bool sends_done = true;
+
+  ~pooled_task() {
+    if (!!coro_) {
+      coro_.destroy();
+    }
+  }
+  pooled_task(pooled_task&& other) noexcept
+    : coro_(std::exchange(other.coro_, {})) {}
+
+  template <typename Receiver>
+  struct operation {
+    using stop_token_t = unifex::stop_token_type_t<Receiver>;
+    static_assert(
+        std::is_same_v<stop_token_t, unifex::inplace_stop_token> ||
+            unifex::is_stop_never_possible_v<stop_token_t>,
+        "pooled_task forwards only an inplace_stop_token");
+
+    std::coroutine_handle<promise_type> coro_;
+    Receiver rec_;
+
+    template <typename Receiver2>
+    operation(std::coroutine_handle<promise_type> coro, Receiver2&& rec)
+      : coro_(coro)
+      , rec_((Receiver2&&)rec) {}
+    operation(operation&&) = delete;
+    ~operation() {
+      if (!!coro_) {
+        coro_.destroy();
+      }
+    }
+
+    void start() noexcept {
+      auto& p = coro_.promise();
+      p.complete_ = &_complete;
+      p.op_ = this;
+      if constexpr (std::is_same_v<stop_token_t, unifex::inplace_stop_token>) {
+        p.stoken_ = unifex::get_stop_token(rec_);
+      }
+      coro_.resume();
+    }
+
+    static void _complete(void* op, promise_type& p) noexcept {
+      auto& self = *static_cast<operation*>(op);
+      if (!!p.error_) {
+        unifex::set_error(std::move(self.rec_), std::move(p.error_));
+      } else if (p.done_) {
+        unifex::set_done(std::move(self.rec_));
+      } else if constexpr (std::is_void_v<T>) {
+        unifex::set_value(std::move(self.rec_));
+      } else {
+        unifex::set_value(std::move(self.rec_), std::move(*p.value_));
+      }
+    }
+  };
+
+  template <typename Receiver>
+  operation<std::remove_cvref_t<Receiver>> connect(Receiver&& rec) && {
+    return {std::exchange(coro_, {}), (Receiver&&)rec};
+  }
+
+private:
+  explicit pooled_task(std::coroutine_handle<promise_type> coro) noexcept
+    : coro_(coro) {}
+
+  std::coroutine_handle<promise_type> coro_;
+};
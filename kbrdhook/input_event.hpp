@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "key_event.hpp"
+#include "latency_trace.hpp"
+
+#include <cstdint>
+#include <type_traits>
+
+// the notification APIs that an input_hub can listen to. combined as a
+// mask to choose the ones it installs.
+enum input_source : unsigned {
+  // WH_MOUSE_LL, delivers mouse_event
+  mouse_hook = 0x1,
+  // WM_INPUT from RegisterRawInputDevices, delivers raw_mouse_event
+  raw_mouse = 0x2,
+  // WM_INPUT from RegisterRawInputDevices, delivers key_event. no low-level
+  // hook, so no cross-process call per keystroke.
+  raw_keyboard = 0x4,
+  // SetWinEventHook, delivers win_event
+  win_events = 0x8
+};
+
+// a mouse message seen by WH_MOUSE_LL, copied out of the MSLLHOOKSTRUCT
+struct mouse_event {
+  latency_trace::stamp_t hookTime_;
+  // screen coordinates
+  std::int32_t x_;
+  std::int32_t y_;
+  // WM_MOUSEMOVE, WM_LBUTTONDOWN, ..
+  std::uint32_t message_;
+  // wheel delta or x button in the high word
+  std::uint32_t mouseData_;
+  // LLMHF_*
+  std::uint32_t flags_;
+  // message time, in ms
+  std::uint32_t time_;
+};
+static_assert(sizeof(mouse_event) == 32, "mouse_event should stay compact");
+
+// a RAWMOUSE report
+struct raw_mouse_event {
+  latency_trace::stamp_t hookTime_;
+  // motion, or the position with MOUSE_MOVE_ABSOLUTE
+  std::int32_t lastX_;
+  std::int32_t lastY_;
+  // message time, in ms
+  std::uint32_t time_;
+  // RI_MOUSE_* button transitions
+  std::uint16_t buttonFlags_;
+  // wheel delta with RI_MOUSE_WHEEL or RI_MOUSE_HWHEEL
+  std::int16_t buttonData_;
+  // MOUSE_MOVE_*
+  std::uint16_t flags_;
+};
+static_assert(
+    sizeof(raw_mouse_event) == 32, "raw_mouse_event should stay compact");
+
+// a WinEvent from SetWinEventHook
+struct win_event {
+  latency_trace::stamp_t hookTime_;
+  // the HWND, 0 when the event is not about a window
+  std::uintptr_t hwnd_;
+  // EVENT_SYSTEM_FOREGROUND, ..
+  std::uint32_t event_;
+  std::int32_t idObject_;
+  std::int32_t idChild_;
+  // event time, in ms
+  std::uint32_t time_;
+};
+static_assert(sizeof(win_event) == 32, "win_event should stay compact");
+
+// any of the events above, as it passes through the ring of an input_hub
+struct input_event {
+  input_source source_;
+  union {
+    mouse_event mouse_;
+    raw_mouse_event rawMouse_;
+    key_event key_;
+    win_event win_;
+  };
+};
+static_assert(std::is_trivially_copyable_v<input_event>);
+
+template <input_source Source>
+struct _input_event_of;
+template <>
+struct _input_event_of<mouse_hook> {
+  using type = mouse_event;
+  static type& get(input_event& e) noexcept { return e.mouse_; }
+};
+template <>
+struct _input_event_of<raw_mouse> {
+  using type = raw_mouse_event;
+  static type& get(input_event& e) noexcept { return e.rawMouse_; }
+};
+template <>
+struct _input_event_of<raw_keyboard> {
+  using type = key_event;
+  static type& get(input_event& e) noexcept { return e.key_; }
+};
+template <>
+struct _input_event_of<win_events> {
+  using type = win_event;
+  static type& get(input_event& e) noexcept { return e.win_; }
+};
+
+// the event type that Source delivers
+template <input_source Source>
+using input_event_t = typename _input_event_of<Source>::type;
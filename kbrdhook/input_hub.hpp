@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/async_manual_reset_event.hpp>
+#include <unifex/just_from.hpp>
+#include <unifex/scheduler_concepts.hpp>
+#include <unifex/sender_concepts.hpp>
+#include <unifex/sequence.hpp>
+
+#include "sender_range.hpp"
+#include "cache_line.hpp"
+#include "com_thread.hpp"
+#include "event_buffer.hpp"
+#include "input_event.hpp"
+#include "iocp_context.hpp"
+#include "latency_trace.hpp"
+#include "memory_budget.hpp"
+
+#include <windows.h>
+#include <winuser.h>
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <exception>
+#include <thread>
+#include <type_traits>
+
+// the mouse hook, raw input and WinEvents behind one set of senders.
+//
+// everything the hub installs is on the uiLoop thread and its callbacks
+// only copy the event into one ring and return, like _keyboard_hook. a
+// drain on a worker dispatches each event to the range that registered for
+// its source:
+//
+//   input_hub hub{com.get_scheduler(), workers.get_scheduler(),
+//       input_source::raw_keyboard | input_source::mouse_hook};
+//   input_events<input_source::raw_keyboard> keys{hub};
+//   input_events<input_source::mouse_hook> mouse{hub};
+//   sync_wait(sequence(hub.start(), ..., hub.destroy()));
+//
+// raw input is read from WM_INPUT on a message-only window, so keystrokes
+// from raw_keyboard cost no cross-process call to the hook and nothing
+// waits on the consumer before the next one is delivered.
+//
+// there is one hub at a time, the hook procedures find it through self_.
+class input_hub {
+public:
+  using scheduler_t = decltype(std::declval<com_thread>().get_scheduler());
+  using drain_scheduler_t =
+      decltype(std::declval<iocp_context>().get_scheduler());
+
+  // returned to sender_range by register_fn()
+  struct registration {
+    input_hub* hub_;
+    input_source source_;
+  };
+
+  ~input_hub() {
+    if (!!mouseHook_ || !!winEventHook_ || !!window_) {
+      // must call destroy()
+      std::terminate();
+    }
+  }
+  // sources is a mask of input_source. win_events reports the events from
+  // winEventMin to winEventMax.
+  input_hub(
+      scheduler_t uiLoop,
+      drain_scheduler_t drain,
+      unsigned sources,
+      DWORD winEventMin = EVENT_SYSTEM_FOREGROUND,
+      DWORD winEventMax = EVENT_SYSTEM_FOREGROUND)
+    : uiLoop_(uiLoop)
+    , drain_(drain)
+    , sources_(sources)
+    , winEventMin_(winEventMin)
+    , winEventMax_(winEventMax)
+    , drainWork_{{&_drain_work}, this} {}
+  input_hub(const input_hub&) = delete;
+
+  // one range per source, the events of a source that no range has
+  // registered for are dropped by the drain
+  template <input_source Source>
+  auto register_fn() noexcept {
+    return [this](auto& fn) noexcept {
+      using fn_t = std::remove_reference_t<decltype(fn)>;
+      auto& s = subscribers_[_index(Source)];
+      s.emit_ = +[](void* target, input_event& event) {
+        (*static_cast<fn_t*>(target))(_input_event_of<Source>::get(event));
+      };
+      void* empty = nullptr;
+      if (!s.target_.compare_exchange_strong(empty, &fn)) {
+        // one range per source
+        std::terminate();
+      }
+      return registration{this, Source};
+    };
+  }
+
+  auto unregister_fn() noexcept {
+    return [](registration& r) noexcept { r.hub_->_unbind(r.source_); };
+  }
+
+  [[nodiscard]] auto start() {
+    return unifex::sequence(
+        unifex::schedule(uiLoop_), unifex::just_from([this]() noexcept {
+          input_hub* empty = nullptr;
+          if (!self_.compare_exchange_strong(empty, this)) {
+            std::terminate();
+          }
+
+          if (!!(sources_ & input_source::mouse_hook)) {
+            mouseHook_ =
+                SetWindowsHookExW(WH_MOUSE_LL, &MouseHookProc, NULL, NULL);
+            if (!mouseHook_) {
+              _fail("failed to set mouse hook");
+            }
+            printf("mouse hook set\n");
+          }
+          if (!!(sources_ &
+                 (input_source::raw_mouse | input_source::raw_keyboard))) {
+            _register_raw_input();
+            printf("raw input registered\n");
+          }
+          if (!!(sources_ & input_source::win_events)) {
+            winEventHook_ = SetWinEventHook(
+                winEventMin_,
+                winEventMax_,
+                NULL,
+                &WinEventProc,
+                0,
+                0,
+                WINEVENT_OUTOFCONTEXT | WINEVENT_SKIPOWNPROCESS);
+            if (!winEventHook_) {
+              _fail("failed to set win event hook");
+            }
+            printf("win event hook set\n");
+          }
+        }));
+  }
+
+  [[nodiscard]] auto destroy() {
+    return unifex::sequence(
+        unifex::schedule(uiLoop_), unifex::just_from([this]() noexcept {
+          if (!!mouseHook_ &&
+              !UnhookWindowsHookEx(std::exchange(mouseHook_, (HHOOK)NULL))) {
+            std::terminate();
+          }
+          if (!!window_) {
+            _unregister_raw_input();
+          }
+          if (!!winEventHook_ &&
+              !UnhookWinEvent(
+                  std::exchange(winEventHook_, (HWINEVENTHOOK)NULL))) {
+            std::terminate();
+          }
+
+          input_hub* expired = this;
+          if (!self_.compare_exchange_strong(expired, nullptr)) {
+            std::terminate();
+          }
+
+          printf("input hub removed\n");
+
+          // nothing is installed, so no drain is posted after this
+          if (drains_.fetch_or(stopped_bit) == 0) {
+            drained_.set();
+          }
+        }),
+        // set by the last drain to return, nothing blocks a worker
+        drained_.async_wait());
+  }
+
+  // number of events lost because the drain fell behind
+  std::size_t dropped() const noexcept { return ring_.dropped(); }
+
+private:
+  using emit_function_t = void (*)(void*, input_event&);
+
+  struct subscriber {
+    emit_function_t emit_{nullptr};
+    std::atomic<void*> target_{nullptr};
+  };
+
+  struct drain_work : iocp_context::work_item {
+    input_hub* self_;
+  };
+
+  static constexpr std::size_t sourceCount = 4;
+  static constexpr std::size_t stopped_bit = ~(~std::size_t{0} >> 1);
+  static constexpr const wchar_t* windowClass = L"kbrdhook_input_hub";
+
+  static constexpr std::size_t _index(input_source source) noexcept {
+    return (std::size_t)std::countr_zero((unsigned)source);
+  }
+
+  [[noreturn]] static void _fail(const char* what) noexcept {
+    LPCWSTR message = nullptr;
+    FormatMessageW(
+        FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM |
+            FORMAT_MESSAGE_IGNORE_INSERTS,
+        NULL,
+        GetLastError(),
+        0,
+        (LPWSTR)&message,
+        128,
+        nullptr);
+
+    printf("%s\n", what);
+    printf("Error: %S\n", message);
+    LocalFree((HLOCAL)message);
+    std::terminate();
+  }
+
+  // uiLoop only
+  void _register_raw_input() noexcept {
+    WNDCLASSEXW wc{};
+    wc.cbSize = sizeof(wc);
+    wc.lpfnWndProc = &RawInputWndProc;
+    wc.hInstance = GetModuleHandleW(NULL);
+    wc.lpszClassName = windowClass;
+    if (!RegisterClassExW(&wc)) {
+      _fail("failed to register the raw input window class");
+    }
+    // message-only, never shown and not enumerated
+    window_ = CreateWindowExW(
+        0,
+        windowClass,
+        L"",
+        0,
+        0,
+        0,
+        0,
+        0,
+        HWND_MESSAGE,
+        NULL,
+        wc.hInstance,
+        NULL);
+    if (!window_) {
+      _fail("failed to create the raw input window");
+    }
+    RAWINPUTDEVICE devices[2];
+    // INPUTSINK delivers the input while other windows have the focus
+    const UINT count = _raw_input_devices(devices, RIDEV_INPUTSINK, window_);
+    if (!RegisterRawInputDevices(devices, count, sizeof(RAWINPUTDEVICE))) {
+      _fail("failed to register raw input devices");
+    }
+  }
+
+  // uiLoop only
+  void _unregister_raw_input() noexcept {
+    RAWINPUTDEVICE devices[2];
+    const UINT count = _raw_input_devices(devices, RIDEV_REMOVE, NULL);
+    if (!RegisterRawInputDevices(devices, count, sizeof(RAWINPUTDEVICE)) ||
+        !DestroyWindow(std::exchange(window_, (HWND)NULL)) ||
+        !UnregisterClassW(windowClass, GetModuleHandleW(NULL))) {
+      std::terminate();
+    }
+  }
+
+  UINT _raw_input_devices(
+      RAWINPUTDEVICE (&devices)[2], DWORD flags, HWND target) const noexcept {
+    // HID_USAGE_PAGE_GENERIC with HID_USAGE_GENERIC_MOUSE or _KEYBOARD
+    UINT count = 0;
+    if (!!(sources_ & input_source::raw_mouse)) {
+      devices[count++] = RAWINPUTDEVICE{0x01, 0x02, flags, target};
+    }
+    if (!!(sources_ & input_source::raw_keyboard)) {
+      devices[count++] = RAWINPUTDEVICE{0x01, 0x06, flags, target};
+    }
+    return count;
+  }
+
+  // uiLoop only, the single producer of ring_
+  void _push(const input_event& event) noexcept {
+    if (!ring_.push(event)) {
+      return;
+    }
+    // seq_cst pairs with _drain(), either a running drain sees the event
+    // or this posts a new one
+    if (!drainPending_.exchange(true)) {
+      drains_.fetch_add(1);
+      drain_.self_->post(&drainWork_);
+    }
+  }
+
+  static void _drain_work(iocp_context::work_item* work) noexcept {
+    static_cast<drain_work*>(work)->self_->_drain();
+  }
+
+  void _drain() noexcept {
+    for (;;) {
+      // seq_cst pairs with _unbind(), either the drain sees no target or
+      // _unbind() waits for the epoch to pass
+      drainEpoch_.fetch_add(1);
+      draining_.store(std::this_thread::get_id());
+      (void)ring_.consume_all([this](input_event& event) noexcept {
+        auto& s = subscribers_[_index(event.source_)];
+        if (void* target = s.target_.load(std::memory_order_acquire)) {
+          s.emit_(target, event);
+        }
+      });
+      draining_.store(std::thread::id{});
+      drainEpoch_.fetch_add(1);
+      drainEpoch_.notify_all();
+      drainPending_.store(false);
+      if (ring_.empty() || drainPending_.exchange(true)) {
+        // nothing left, or a callback posted another drain for it
+        break;
+      }
+    }
+    // after the last drain has returned, destroy() may complete
+    if (drains_.fetch_sub(1) == (stopped_bit | 1)) {
+      drained_.set();
+    }
+  }
+
+  void _unbind(input_source source) noexcept {
+    subscribers_[_index(source)].target_.store(nullptr);
+    if (draining_.load() == std::this_thread::get_id()) {
+      // a range stopped from inside the drain does not wait for itself
+      return;
+    }
+    // a later epoch does not see the target, wait out the one dispatching
+    const auto epoch = drainEpoch_.load();
+    if ((epoch & 1) != 0) {
+      drainEpoch_.wait(epoch);
+    }
+  }
+
+  static LRESULT CALLBACK
+  MouseHookProc(_In_ int nCode, _In_ WPARAM wParam, _In_ LPARAM lParam) {
+    input_hub* self = self_.load();
+    if (!!self && nCode >= 0) {
+      auto hookTime = latency_trace::now();
+      const auto& mouse = *reinterpret_cast<const MSLLHOOKSTRUCT*>(lParam);
+      input_event event{input_source::mouse_hook, {}};
+      event.mouse_ = mouse_event{
+          hookTime,
+          (std::int32_t)mouse.pt.x,
+          (std::int32_t)mouse.pt.y,
+          (std::uint32_t)wParam,
+          (std::uint32_t)mouse.mouseData,
+          (std::uint32_t)mouse.flags,
+          (std::uint32_t)mouse.time};
+      self->_push(event);
+      return CallNextHookEx(self->mouseHook_, nCode, wParam, lParam);
+    }
+    return CallNextHookEx(NULL, nCode, wParam, lParam);
+  }
+
+  static LRESULT CALLBACK RawInputWndProc(
+      HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam) {
+    input_hub* self = self_.load();
+    if (!!self && message == WM_INPUT) {
+      auto hookTime = latency_trace::now();
+      RAWINPUT raw;
+      UINT size = sizeof(raw);
+      if (GetRawInputData(
+              (HRAWINPUT)lParam,
+              RID_INPUT,
+              &raw,
+              &size,
+              sizeof(RAWINPUTHEADER)) != (UINT)-1) {
+        self->_push_raw(raw, hookTime);
+      }
+    }
+    // for WM_INPUT this lets the system release the input
+    return DefWindowProcW(hwnd, message, wParam, lParam);
+  }
+
+  void _push_raw(
+      const RAWINPUT& raw, latency_trace::stamp_t hookTime) noexcept {
+    const auto time = (std::uint32_t)GetMessageTime();
+    if (raw.header.dwType == RIM_TYPEMOUSE) {
+      const auto& mouse = raw.data.mouse;
+      input_event event{input_source::raw_mouse, {}};
+      event.rawMouse_ = raw_mouse_event{
+          hookTime,
+          (std::int32_t)mouse.lLastX,
+          (std::int32_t)mouse.lLastY,
+          time,
+          (std::uint16_t)mouse.usButtonFlags,
+          (std::int16_t)mouse.usButtonData,
+          (std::uint16_t)mouse.usFlags};
+      _push(event);
+    } else if (raw.header.dwType == RIM_TYPEKEYBOARD) {
+      const auto& key = raw.data.keyboard;
+      if (key.VKey == 0xFF) {
+        // part of an escape sequence, not a key
+        return;
+      }
+      // the same flags as the LL hook would have reported
+      std::uint8_t flags = 0;
+      if (!!(key.Flags & RI_KEY_BREAK)) {
+        flags |= key_event::up_flag;
+      }
+      if (!!(key.Flags & RI_KEY_E0)) {
+        flags |= key_event::extended_flag;
+      }
+      input_event event{input_source::raw_keyboard, {}};
+      event.key_ = key_event{
+          hookTime,
+          time,
+          (std::uint16_t)key.MakeCode,
+          (std::uint8_t)key.VKey,
+          flags};
+      _push(event);
+    }
+  }
+
+  static void CALLBACK WinEventProc(
+      HWINEVENTHOOK,
+      DWORD eventId,
+      HWND hwnd,
+      LONG idObject,
+      LONG idChild,
+      DWORD,
+      DWORD eventTime) {
+    input_hub* self = self_.load();
+    if (!self) {
+      return;
+    }
+    input_event event{input_source::win_events, {}};
+    event.win_ = win_event{
+        latency_trace::now(),
+        (std::uintptr_t)hwnd,
+        (std::uint32_t)eventId,
+        (std::int32_t)idObject,
+        (std::int32_t)idChild,
+        (std::uint32_t)eventTime};
+    self->_push(event);
+  }
+
+  scheduler_t uiLoop_;
+  drain_scheduler_t drain_;
+  const unsigned sources_;
+  const DWORD winEventMin_;
+  const DWORD winEventMax_;
+  HHOOK mouseHook_{NULL};
+  HWINEVENTHOOK winEventHook_{NULL};
+  HWND window_{NULL};
+  subscriber subscribers_[sourceCount];
+  // events of every source waiting for the drain
+  spsc_ring<input_event, 256> ring_;
+  memory_charge charge_{memory_budget::ranges, sizeof(ring_)};
+  // set while a drain is posted or running, so there is one at a time.
+  // written by the callbacks and the drain, away from the fields they read.
+  alignas(cache_line_size) std::atomic<bool> drainPending_{false};
+  // the thread of the running drain, none between drains
+  std::atomic<std::thread::id> draining_{};
+  // odd while a drain dispatches, _unbind() waits for it to change
+  std::atomic<std::uint32_t> drainEpoch_{0};
+  // drains posted and not yet returned, plus stopped_bit once destroy() has
+  // removed everything. whoever leaves only stopped_bit sets drained_.
+  std::atomic<std::size_t> drains_{0};
+  drain_work drainWork_;
+  unifex::async_manual_reset_event drained_;
+
+  // read by every callback, on a line of its own
+  alignas(cache_line_size) static inline std::atomic<input_hub*> self_{
+      nullptr};
+};
+
+// the events of one source of an input_hub, delivered like keyboard_hook
+// delivers keystrokes
+template <
+    input_source Source,
+    typename BufferPolicy = buffered<64, overflow_policy::drop_oldest>>
+class input_events {
+  using RangeType = sender_range<
+      input_event_t<Source>,
+      unifex::inplace_stop_token,
+      decltype(std::declval<input_hub&>().template register_fn<Source>()),
+      decltype(std::declval<input_hub&>().unregister_fn()),
+      BufferPolicy>;
+
+  unifex::inplace_stop_source stopSource_;
+  memory_charge charge_{memory_budget::ranges, sizeof(RangeType)};
+  RangeType range_;
+
+public:
+  explicit input_events(input_hub& hub)
+    : range_(
+          stopSource_.get_token(),
+          hub.template register_fn<Source>(),
+          hub.unregister_fn()) {}
+
+  unifex::inplace_stop_source& get_stop_source() { return stopSource_; }
+  void request_stop() { stopSource_.request_stop(); }
+
+  auto events() { return range_.view(); }
+
+  // each sender completes with every event since the previous one
+  template <std::size_t MaxBatch>
+  auto event_batches() {
+    return range_.template batches<MaxBatch>();
+  }
+
+  // number of events lost to the buffer policy
+  std::size_t dropped() const noexcept { return range_.dropped(); }
+};
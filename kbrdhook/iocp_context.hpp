@@ -0,0 +1,447 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/get_stop_token.hpp>
+#include <unifex/receiver_concepts.hpp>
+#include <unifex/scheduler_concepts.hpp>
+#include <unifex/scope_guard.hpp>
+#include <unifex/sender_concepts.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <windows.h>
+
+// a pool of worker threads that run work posted to an I/O completion port.
+//
+// schedule() completes on any worker. schedule_at() and schedule_after()
+// keep the pending timers in a deadline ordered list and arm one waitable
+// timer for the earliest of them. the timer is only ever set by worker 0,
+// which waits alertably, so the timer completion runs there without a
+// thread of its own and posts the expired timers back to the port.
+//
+// the workers do not pump messages, so hooks and single threaded COM stay
+// on com_thread. this takes the timers and the work that may block. the
+// workers are in the COM multithreaded apartment.
+struct iocp_context {
+  using clock_t = std::chrono::steady_clock;
+  using time_point = clock_t::time_point;
+
+  // an item of work posted to the port
+  struct work_item {
+    void (*execute_)(work_item*) noexcept;
+  };
+
+  ~iocp_context() {
+    join();
+    CloseHandle(timer_);
+    CloseHandle(port_);
+  }
+  explicit iocp_context(std::size_t workers = 1)
+    : port_(_create_port(workers))
+    , timer_(_create_timer()) {
+    if (workers == 0) {
+      std::terminate();
+    }
+    workers_.reserve(workers);
+    for (std::size_t id = 0; id != workers; ++id) {
+      workers_.emplace_back([this, id]() noexcept { _run(id == 0); });
+    }
+  }
+  iocp_context(const iocp_context&) = delete;
+
+  // runs the work posted before it, then stops the workers. timers must
+  // not be pending.
+  void join() {
+    if (workers_.empty()) {
+      return;
+    }
+    for (std::size_t i = 0; i != workers_.size(); ++i) {
+      // a null key tells one worker to exit
+      if (!PostQueuedCompletionStatus(port_, 0, 0, nullptr)) {
+        std::terminate();
+      }
+    }
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+    workers_.clear();
+    if (timers_ != nullptr) {
+      // a timer outlived its context
+      std::terminate();
+    }
+  }
+
+  time_point now() const noexcept { return clock_t::now(); }
+
+  // runs work on a worker. the item may be posted again once it has
+  // started to run, so a producer can keep one preallocated item.
+  void post(work_item* work) noexcept { _post(work); }
+
+  enum class timer_state { idle, queued, cancelled, expired };
+
+  // a pending timer. execute_ runs on a worker when it expires or is
+  // cancelled.
+  struct timer_item : work_item {
+    time_point due_;
+    timer_state state_{timer_state::idle};
+    timer_item* prev_{nullptr};
+    timer_item* next_{nullptr};
+
+    bool cancelled() const noexcept {
+      return state_ == timer_state::cancelled;
+    }
+  };
+
+  // arms a preallocated timer without a sender, e.g. again from its own
+  // execute_. the timer must not be pending.
+  void arm(timer_item& timer, time_point due) noexcept {
+    timer.due_ = due;
+    timer.state_ = timer_state::idle;
+    _insert(timer);
+  }
+
+  // a pending timer is removed and runs as cancelled. a timer that has
+  // already expired runs as expired.
+  void disarm(timer_item& timer) noexcept { _cancel(timer); }
+
+private:
+
+  template <typename Receiver>
+  struct schedule_operation : work_item {
+    iocp_context* self_;
+    Receiver rec_;
+
+    schedule_operation(iocp_context* self, Receiver rec)
+      : work_item{&_execute}
+      , self_(self)
+      , rec_(std::move(rec)) {}
+    schedule_operation(schedule_operation&&) = delete;
+
+    static void _execute(work_item* work) noexcept {
+      auto& op = *static_cast<schedule_operation*>(work);
+      unifex::set_value(std::move(op.rec_));
+    }
+
+    void start() noexcept { self_->_post(this); }
+  };
+
+  struct schedule_sender {
+    template <
+        template <typename...>
+        class Variant,
+        template <typename...>
+        class Tuple>
+    using value_types = Variant<Tuple<>>;
+    template <template <typename...> class Variant>
+    using error_types = Variant<>;
+    static inline constexpr bool sends_done = false;
+
+    iocp_context* self_;
+
+    template <typename Receiver>
+    schedule_operation<Receiver> connect(Receiver rec) {
+      return {self_, std::move(rec)};
+    }
+  };
+
+  template <typename Receiver>
+  struct timer_operation : timer_item {
+    struct on_stop {
+      timer_operation* op_;
+      void operator()() const noexcept { op_->self_->_cancel(*op_); }
+    };
+    using stop_callback_t = typename unifex::stop_token_type_t<
+        Receiver>::template callback_type<on_stop>;
+
+    iocp_context* self_;
+    Receiver rec_;
+    std::optional<stop_callback_t> onStop_{};
+
+    timer_operation(iocp_context* self, time_point due, Receiver rec)
+      : timer_item{{&_execute}, due}
+      , self_(self)
+      , rec_(std::move(rec)) {}
+    timer_operation(timer_operation&&) = delete;
+
+    static void _execute(work_item* work) noexcept {
+      auto& op = *static_cast<timer_operation*>(work);
+      op.onStop_.reset();
+      if (op.state_ == timer_state::cancelled) {
+        unifex::set_done(std::move(op.rec_));
+      } else {
+        unifex::set_value(std::move(op.rec_));
+      }
+    }
+
+    void start() noexcept {
+      // a stop request from inside emplace() only marks the timer, the
+      // insert below completes it
+      onStop_.emplace(unifex::get_stop_token(rec_), on_stop{this});
+      self_->_insert(*this);
+    }
+  };
+
+  struct timer_sender {
+    template <
+        template <typename...>
+        class Variant,
+        template <typename...>
+        class Tuple>
+    using value_types = Variant<Tuple<>>;
+    template <template <typename...> class Variant>
+    using error_types = Variant<>;
+    static inline constexpr bool sends_done = true;
+
+    iocp_context* self_;
+    time_point due_;
+
+    template <typename Receiver>
+    timer_operation<Receiver> connect(Receiver rec) {
+      return {self_, due_, std::move(rec)};
+    }
+  };
+
+public:
+  struct _scheduler {
+    iocp_context* self_;
+    _scheduler() = delete;
+    explicit _scheduler(iocp_context* self) : self_(self) {}
+    _scheduler(const _scheduler&) = default;
+    _scheduler(_scheduler&&) = default;
+
+    schedule_sender schedule() const noexcept { return {self_}; }
+
+    timer_sender schedule_at(time_point due) const noexcept {
+      return {self_, due};
+    }
+
+    template <typename Rep, typename Period>
+    timer_sender
+    schedule_after(std::chrono::duration<Rep, Period> delay) const noexcept {
+      return {
+          self_,
+          self_->now() + std::chrono::duration_cast<clock_t::duration>(delay)};
+    }
+
+    time_point now() const noexcept { return self_->now(); }
+
+    friend bool operator==(_scheduler a, _scheduler b) noexcept {
+      return a.self_ == b.self_;
+    }
+    friend bool operator!=(_scheduler a, _scheduler b) noexcept {
+      return a.self_ != b.self_;
+    }
+  };
+  _scheduler get_scheduler() { return _scheduler{this}; }
+
+private:
+  static HANDLE _create_port(std::size_t workers) noexcept {
+    HANDLE port = CreateIoCompletionPort(
+        INVALID_HANDLE_VALUE, NULL, 0, static_cast<DWORD>(workers));
+    if (!port) {
+      std::terminate();
+    }
+    return port;
+  }
+
+  static HANDLE _create_timer() noexcept {
+    HANDLE timer = CreateWaitableTimerExW(
+        NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS);
+    if (!timer) {
+      // high resolution timers need windows 10 1803
+      timer = CreateWaitableTimerW(NULL, FALSE, NULL);
+    }
+    if (!timer) {
+      std::terminate();
+    }
+    return timer;
+  }
+
+  void _run(bool timerWorker) noexcept {
+    if (FAILED(CoInitializeEx(nullptr, COINIT_MULTITHREADED))) {
+      std::terminate();
+    }
+    unifex::scope_guard uninitialize{[]() noexcept { CoUninitialize(); }};
+    for (;;) {
+      OVERLAPPED_ENTRY entry = {};
+      ULONG count = 0;
+      if (!GetQueuedCompletionStatusEx(
+              port_, &entry, 1, &count, INFINITE, timerWorker)) {
+        if (GetLastError() == WAIT_IO_COMPLETION) {
+          // ran a timer apc
+          continue;
+        }
+        std::terminate();
+      }
+      auto* work = reinterpret_cast<work_item*>(entry.lpCompletionKey);
+      if (!work) {
+        return;
+      }
+      work->execute_(work);
+    }
+  }
+
+  void _post(work_item* work) noexcept {
+    if (!PostQueuedCompletionStatus(
+            port_, 0, reinterpret_cast<ULONG_PTR>(work), nullptr)) {
+      std::terminate();
+    }
+  }
+
+  void _insert(timer_item& timer) noexcept {
+    bool cancelled = false;
+    bool rearm = false;
+    {
+      std::lock_guard lock{lock_};
+      if (timer.state_ == timer_state::cancelled) {
+        cancelled = true;
+      } else {
+        timer.state_ = timer_state::queued;
+        _link(timer);
+        if (timer.due_ < armedDue_) {
+          armedDue_ = timer.due_;
+          rearm = true;
+        }
+      }
+    }
+    if (cancelled) {
+      _post(&timer);
+    } else if (rearm) {
+      // only worker 0 sets the timer, so that it gets the completion
+      if (!QueueUserAPC(
+              &_rearm_apc,
+              workers_.front().native_handle(),
+              reinterpret_cast<ULONG_PTR>(this))) {
+        std::terminate();
+      }
+    }
+  }
+
+  void _cancel(timer_item& timer) noexcept {
+    {
+      std::lock_guard lock{lock_};
+      if (timer.state_ == timer_state::idle) {
+        // stopped before it was inserted
+        timer.state_ = timer_state::cancelled;
+        return;
+      }
+      if (timer.state_ != timer_state::queued) {
+        // already expired
+        return;
+      }
+      _unlink(timer);
+      timer.state_ = timer_state::cancelled;
+    }
+    // the timer stays armed, an early completion finds nothing due
+    _post(&timer);
+  }
+
+  // keeps timers_ sorted by due_, timers with the same due_ run in order
+  void _link(timer_item& timer) noexcept {
+    timer_item* after = nullptr;
+    timer_item* before = timers_;
+    while (!!before && !(timer.due_ < before->due_)) {
+      after = std::exchange(before, before->next_);
+    }
+    timer.prev_ = after;
+    timer.next_ = before;
+    (!!after ? after->next_ : timers_) = &timer;
+    if (!!before) {
+      before->prev_ = &timer;
+    }
+  }
+
+  void _unlink(timer_item& timer) noexcept {
+    (!!timer.prev_ ? timer.prev_->next_ : timers_) = timer.next_;
+    if (!!timer.next_) {
+      timer.next_->prev_ = timer.prev_;
+    }
+    timer.prev_ = timer.next_ = nullptr;
+  }
+
+  // the apcs below run on worker 0
+
+  static void CALLBACK _rearm_apc(ULONG_PTR self) noexcept {
+    reinterpret_cast<iocp_context*>(self)->_arm();
+  }
+
+  static void CALLBACK _timer_apc(LPVOID self, DWORD, DWORD) noexcept {
+    static_cast<iocp_context*>(self)->_expire();
+  }
+
+  void _arm() noexcept {
+    time_point due;
+    {
+      std::lock_guard lock{lock_};
+      if (!timers_) {
+        armedDue_ = time_point::max();
+        return;
+      }
+      due = armedDue_ = timers_->due_;
+    }
+    // relative, in 100ns units
+    using filetime_ticks =
+        std::chrono::duration<LONGLONG, std::ratio<1, 10000000>>;
+    auto delay =
+        std::chrono::duration_cast<filetime_ticks>(due - now()).count();
+    LARGE_INTEGER dueTime;
+    dueTime.QuadPart = -std::max<LONGLONG>(delay, 1);
+    if (!SetWaitableTimer(timer_, &dueTime, 0, &_timer_apc, this, FALSE)) {
+      std::terminate();
+    }
+  }
+
+  void _expire() noexcept {
+    timer_item* expired = nullptr;
+    {
+      std::lock_guard lock{lock_};
+      const auto current = now();
+      timer_item** tail = &expired;
+      while (!!timers_ && !(current < timers_->due_)) {
+        timer_item* timer = timers_;
+        _unlink(*timer);
+        timer->state_ = timer_state::expired;
+        *tail = timer;
+        tail = &timer->next_;
+      }
+      armedDue_ = time_point::max();
+    }
+    while (!!expired) {
+      // the timer may be gone once it is posted
+      _post(std::exchange(expired, expired->next_));
+    }
+    _arm();
+  }
+
+  HANDLE port_;
+  HANDLE timer_;
+  std::mutex lock_;
+  // pending timers, earliest first
+  timer_item* timers_{nullptr};
+  // the deadline the waitable timer is set, or about to be set, for
+  time_point armedDue_{time_point::max()};
+  std::vector<std::thread> workers_;
+};
@@ -14,8 +14,6 @@
  * limitations under the License.
  */
 
-#include <unifex/coroutine.hpp>
-#include <unifex/done_as_optional.hpp>
 #include <unifex/inplace_stop_token.hpp>
 #include <unifex/let_done.hpp>
 #include <unifex/let_value.hpp>
@@ -24,52 +22,140 @@
 #include <unifex/sender_concepts.hpp>
 #include <unifex/sequence.hpp>
 #include <unifex/sync_wait.hpp>
-#include <unifex/task.hpp>
-#include <unifex/timed_single_thread_context.hpp>
 #include <unifex/when_all.hpp>
 
 #include <cassert>
 #include <chrono>
+#include <cwchar>
 #include <optional>
 
 #include "clean_stop.hpp"
+#include "clickety.hpp"
 #include "com_thread.hpp"
+#include "components.hpp"
+#include "frame_pool.hpp"
+#include "input_hub.hpp"
+#include "iocp_context.hpp"
 #include "keyboard_hook.hpp"
+#include "latency_trace.hpp"
+#include "memory_budget.hpp"
 #include "player.hpp"
+#include "stop_watchdog.hpp"
+#include "wasapi_player.hpp"
 
-unifex::task<void> clickety(Player& player, keyboard_hook& keyboard) {
-  for (auto next : keyboard.events()) {
-    auto evt = co_await unifex::done_as_optional(std::move(next));
-    if (!evt) {
-      break;
-    }
-    player.Click();
-  }
+// keyboard delivers the keystrokes, source is the component that installs
+// whatever produces them (the same object for keyboard_hook)
+template <typename ClickPlayer, typename Keyboard, typename Source>
+void run(
+    com_thread& com, ClickPlayer& player, Keyboard& keyboard, Source& source) {
+  clean_stop exit{com.get_scheduler()};
+  frame_pool frames{4096, 2};
+  // none depends on another. the hook is usually set long before the
+  // player has loaded, keystrokes in between wait in the keyboard buffer.
+  auto components = together(exit, player, source);
+  // reports a shutdown that has not finished soon after ctrl-C
+  stop_watchdog watchdog{std::chrono::seconds(2)};
+  std::optional<stop_watchdog::watch_id> shutdown;
 
-  co_return;
+  const auto startedAt = std::chrono::steady_clock::now();
+  unifex::sync_wait(unifex::sequence(
+      // start
+      components.start(),
+      unifex::just_from([startedAt]() {
+        printf(
+            "started in %lldms\n",
+            (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - startedAt)
+                .count());
+        printf("press ctrl-C to stop, ctrl-Break for latency...\n");
+      }),
+      // click
+      clickety(std::allocator_arg, frames, player, keyboard) |
+          unifex::stop_when(
+              // until ctrl+C
+              unifex::sequence(exit.event(), unifex::just_from([&]() {
+                                 shutdown = watchdog.begin("shutdown");
+                               }))),
+      // stop
+      components.destroy(),
+      unifex::just_from([&]() {
+        if (shutdown) {
+          (void)watchdog.end(*shutdown);
+        }
+      })));
+
+  auto frameStats = frames.stats();
+  printf(
+      "clickety frames: %zu pooled, %zu from the heap\n",
+      frameStats.pooled_,
+      frameStats.heap_);
 }
 
-int wmain() {
+// the caps of --bounded, a few times what a normal session uses
+void bounded_limits() {
+  auto& budget = memory_budget::instance();
+  budget.set_limit(memory_budget::frames, 16 * 1024);
+  budget.set_limit(memory_budget::clicks, 64 * 1024);
+  budget.set_limit(memory_budget::voices, 2 * 1024 * 1024);
+  budget.set_limit(memory_budget::ranges, 64 * 1024);
+}
+
+// kbrdhook [--wasapi] [--raw-input] [--bounded] [path to a local click sample]
+//
+// --wasapi mixes the sample into a WASAPI render buffer instead of playing
+// it through MFPlay, and needs the local sample.
+// --raw-input reads the keyboard through raw input instead of the low-level
+// keyboard hook.
+// --bounded caps the memory of each component, see bounded_limits. clicks
+// over the cap are dropped instead of allocating.
+int wmain(int argc, wchar_t* argv[]) {
   printf("main start\n");
   unifex::scope_guard mainExit{[]() noexcept {
     printf("main exit\n");
   }};
-  using namespace std::literals::chrono_literals;
 
-  com_thread com{50ms};
-  clean_stop exit{com.get_scheduler()};
-  Player player{com.get_scheduler()};
-  keyboard_hook keyboard{com.get_scheduler()};
+  bool wasapi = false;
+  bool rawInput = false;
+  PCWSTR samplePath = nullptr;
+  for (int arg = 1; arg < argc; ++arg) {
+    if (std::wcscmp(argv[arg], L"--wasapi") == 0) {
+      wasapi = true;
+    } else if (std::wcscmp(argv[arg], L"--raw-input") == 0) {
+      rawInput = true;
+    } else if (std::wcscmp(argv[arg], L"--bounded") == 0) {
+      bounded_limits();
+    } else {
+      samplePath = argv[arg];
+    }
+  }
+  if (wasapi && !samplePath) {
+    printf("--wasapi needs a local click sample\n");
+    return 1;
+  }
 
-  unifex::sync_wait(unifex::sequence(
-      // start
-      unifex::sequence(exit.start(), player.start(), keyboard.start()),
-      unifex::just_from([]() { printf("press ctrl-C to stop...\n"); }),
-      // click
-      clickety(player, keyboard) |
-          unifex::stop_when(
-              // until ctrl+C
-              exit.event()),
-      // stop
-      unifex::sequence(keyboard.destroy(), player.destroy(), exit.destroy())));
-}
\ No newline at end of file
+  // the hook and MFPlay stay on the com thread, the rest goes to workers
+  com_thread com;
+  iocp_context workers{2};
+  auto withKeyboard = [&](auto& player) {
+    if (rawInput) {
+      input_hub hub{
+          com.get_scheduler(),
+          workers.get_scheduler(),
+          input_source::raw_keyboard};
+      input_events<input_source::raw_keyboard> keyboard{hub};
+      run(com, player, keyboard, hub);
+    } else {
+      keyboard_hook keyboard{com.get_scheduler(), workers.get_scheduler()};
+      run(com, player, keyboard, keyboard);
+    }
+  };
+  if (wasapi) {
+    WasapiPlayer player{workers.get_scheduler(), samplePath};
+    withKeyboard(player);
+  } else {
+    Player player{com.get_scheduler(), workers.get_scheduler(), 4, samplePath};
+    withKeyboard(player);
+  }
+  latency_trace::instance().print_summary();
+  memory_budget::instance().print_summary();
+}
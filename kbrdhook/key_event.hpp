@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "latency_trace.hpp"
+
+#include <cstdint>
+#include <type_traits>
+
+// a key press or release, copied out of the KBDLLHOOKSTRUCT (or a
+// RAWKEYBOARD) and stamped when the hook saw it. it fits in 16 bytes and is
+// trivially copyable, so the ring and buffer slots hold it directly.
+struct key_event {
+  // the KBDLLHOOKSTRUCT flags (LLKHF_*)
+  enum : std::uint8_t {
+    extended_flag = 0x01,
+    lower_il_injected_flag = 0x02,
+    injected_flag = 0x10,
+    alt_down_flag = 0x20,
+    up_flag = 0x80
+  };
+
+  latency_trace::stamp_t hookTime_;
+  // message time, in ms
+  std::uint32_t time_;
+  std::uint16_t scanCode_;
+  std::uint8_t vkCode_;
+  std::uint8_t flags_;
+
+  bool down() const noexcept { return (flags_ & up_flag) == 0; }
+  bool injected() const noexcept { return (flags_ & injected_flag) != 0; }
+
+  // shift, ctrl, alt and the windows keys, left, right or either
+  bool modifier() const noexcept {
+    return (vkCode_ >= 0x10 && vkCode_ <= 0x12) ||  // VK_SHIFT..VK_MENU
+        (vkCode_ >= 0xA0 && vkCode_ <= 0xA5) ||     // VK_LSHIFT..VK_RMENU
+        vkCode_ == 0x5B || vkCode_ == 0x5C;         // VK_LWIN, VK_RWIN
+  }
+};
+static_assert(sizeof(key_event) == 16, "key_event should stay compact");
+static_assert(std::is_trivially_copyable_v<key_event>);
+
+template <>
+inline constexpr bool latency_traced_v<key_event> = true;
@@ -16,6 +16,7 @@
 
 #pragma once
 
+#include <unifex/async_manual_reset_event.hpp>
 #include <unifex/just_from.hpp>
 #include <unifex/manual_event_loop.hpp>
 #include <unifex/scheduler_concepts.hpp>
@@ -23,7 +24,13 @@
 #include <unifex/sequence.hpp>
 
 #include "sender_range.hpp"
+#include "cache_line.hpp"
 #include "com_thread.hpp"
+#include "event_buffer.hpp"
+#include "iocp_context.hpp"
+#include "key_event.hpp"
+#include "latency_trace.hpp"
+#include "memory_budget.hpp"
 
 #include <windows.h>
 #include <windowsx.h>
@@ -31,16 +38,40 @@
 
 #include <atomic>
 
+// the hook procedure only copies the keystroke into a ring and returns.
+// the events are dispatched to fn_ by a drain on a worker, so consumers
+// never run on the thread that pumps the hook.
 template <typename Fn>
 struct _keyboard_hook {
   using scheduler_t = decltype(std::declval<com_thread>().get_scheduler());
+  using drain_scheduler_t =
+      decltype(std::declval<iocp_context>().get_scheduler());
+
+  struct drain_work : iocp_context::work_item {
+    _keyboard_hook* self_;
+  };
 
   Fn& fn_;
   scheduler_t uiLoop_;
+  drain_scheduler_t drain_;
   unifex::inplace_stop_token token_;
   HHOOK hHook_;
+  // keystrokes waiting for the drain
+  spsc_ring<key_event, 256> ring_;
+  // set while a drain is posted or running, so there is one at a time.
+  // written by the hook and the drain, away from the fields the hook reads.
+  alignas(cache_line_size) std::atomic<bool> drainPending_{false};
+  // drains posted and not yet returned, plus stopped_bit once destroy() has
+  // removed the hook. whoever leaves only stopped_bit sets drained_.
+  std::atomic<std::size_t> drains_{0};
+  drain_work drainWork_;
+  unifex::async_manual_reset_event drained_;
+
+  static inline constexpr std::size_t stopped_bit = ~(~std::size_t{0} >> 1);
 
-  static inline std::atomic<_keyboard_hook*> self_{nullptr};
+  // read by every call of the hook procedure, on a line of its own
+  alignas(cache_line_size) static inline std::atomic<_keyboard_hook*> self_{
+      nullptr};
 
   ~_keyboard_hook() {
     if (!!hHook_) {
@@ -48,10 +79,12 @@ struct _keyboard_hook {
       std::terminate();
     }
   }
-  explicit _keyboard_hook(Fn& fn, scheduler_t uiLoop)
+  explicit _keyboard_hook(Fn& fn, scheduler_t uiLoop, drain_scheduler_t drain)
     : fn_(fn)
     , uiLoop_(uiLoop)
-    , hHook_(NULL) {}
+    , drain_(drain)
+    , hHook_(NULL)
+    , drainWork_{{&_drain_work}, this} {}
 
   [[nodiscard]] auto start() {
     return unifex::sequence(
@@ -97,15 +130,68 @@ struct _keyboard_hook {
           }
 
           printf("keyboard hook removed\n");
-        }));
+
+          // the hook is gone, so no drain is posted after this
+          if (drains_.fetch_or(stopped_bit) == 0) {
+            drained_.set();
+          }
+        }),
+        // set by the last drain to return, nothing blocks a worker
+        drained_.async_wait());
+  }
+
+  // hook thread only
+  void _push(const key_event& event) noexcept {
+    if (!ring_.push(event)) {
+      return;
+    }
+    // seq_cst pairs with _drain(), either a running drain sees the event
+    // or this posts a new one
+    if (!drainPending_.exchange(true)) {
+      drains_.fetch_add(1);
+      drain_.self_->post(&drainWork_);
+    }
   }
 
+  static void _drain_work(iocp_context::work_item* work) noexcept {
+    static_cast<drain_work*>(work)->self_->_drain();
+  }
+
+  void _drain() noexcept {
+    for (;;) {
+      // dispatched from the ring slot, the range copies only what it keeps
+      (void)ring_.consume_all(
+          [this](key_event& event) noexcept { fn_(event); });
+      drainPending_.store(false);
+      if (ring_.empty() || drainPending_.exchange(true)) {
+        // nothing left, or the hook posted another drain for it
+        break;
+      }
+    }
+    // after the last drain has returned, destroy() may complete
+    if (drains_.fetch_sub(1) == (stopped_bit | 1)) {
+      drained_.set();
+    }
+  }
+
+  // number of keystrokes lost because the drain fell behind
+  std::size_t dropped() const noexcept { return ring_.dropped(); }
+
   static LRESULT CALLBACK
   KbdHookProc(_In_ int nCode, _In_ WPARAM wParam, _In_ LPARAM lParam) {
     _keyboard_hook* self = self_.load();
     if (!!self && nCode >= 0 &&
-        (wParam == WM_KEYDOWN || wParam == WM_SYSKEYDOWN)) {
-      self->fn_(wParam);
+        (wParam == WM_KEYDOWN || wParam == WM_SYSKEYDOWN ||
+         wParam == WM_KEYUP || wParam == WM_SYSKEYUP)) {
+      auto hookTime = latency_trace::now();
+      const auto& key = *reinterpret_cast<const KBDLLHOOKSTRUCT*>(lParam);
+      // LLKHF_UP tells the releases apart
+      self->_push(key_event{
+          hookTime,
+          (std::uint32_t)key.time,
+          (std::uint16_t)key.scanCode,
+          (std::uint8_t)key.vkCode,
+          (std::uint8_t)key.flags});
       return CallNextHookEx(self->hHook_, nCode, wParam, lParam);
     }
     return CallNextHookEx(NULL, nCode, wParam, lParam);
@@ -115,10 +201,10 @@ struct _keyboard_hook {
 namespace detail {
 // create a range of senders where each sender completes on the next
 // keyboard press
-template <typename Scheduler>
-auto keyboard_events(Scheduler uiLoop) {
-  static auto register_ = [uiLoop](auto& fn) noexcept {
-    return _keyboard_hook<decltype(fn)>{fn, uiLoop};
+template <typename Scheduler, typename DrainScheduler>
+auto keyboard_events(Scheduler uiLoop, DrainScheduler drain) {
+  static auto register_ = [uiLoop, drain](auto& fn) noexcept {
+    return _keyboard_hook<decltype(fn)>{fn, uiLoop, drain};
   };
   static auto unregister_ = [](auto& r) noexcept {
     // caller is responsible for destroy()
@@ -129,22 +215,31 @@ auto keyboard_events(Scheduler uiLoop) {
 class keyboard_hook {
   using scheduler_t =
       decltype(std::declval<com_thread>().get_scheduler());
-  using fns = decltype(detail::keyboard_events(std::declval<scheduler_t&>()));
+  using drain_scheduler_t =
+      decltype(std::declval<iocp_context>().get_scheduler());
+  using fns = decltype(detail::keyboard_events(
+      std::declval<scheduler_t&>(), std::declval<drain_scheduler_t&>()));
   using RangeType = sender_range<
-      WPARAM,
+      key_event,
       unifex::inplace_stop_token,
       typename fns::first_type,
-      typename fns::second_type>;
+      typename fns::second_type,
+      // keep keystrokes that arrive while clickety is busy, or before it
+      // starts while the player is still loading
+      buffered<64, overflow_policy::drop_oldest>>;
 
   unifex::inplace_stop_source stopSource_;
+  // the range holds the buffer and the hook with its ring
+  memory_charge charge_{memory_budget::ranges, sizeof(RangeType)};
   RangeType range_;
 
 public:
-  explicit keyboard_hook(scheduler_t uiLoop)
+  // the hook runs on uiLoop, consumers resume on drain
+  keyboard_hook(scheduler_t uiLoop, drain_scheduler_t drain)
     : range_(
           stopSource_.get_token(),
-          detail::keyboard_events(uiLoop).first,
-          detail::keyboard_events(uiLoop).second) {}
+          detail::keyboard_events(uiLoop, drain).first,
+          detail::keyboard_events(uiLoop, drain).second) {}
 
   unifex::inplace_stop_source& get_stop_source() { return stopSource_; }
   void request_stop() { stopSource_.request_stop(); }
@@ -153,4 +248,10 @@ public:
   [[nodiscard]] auto destroy() { return range_.get_registration()->destroy(); }
 
   auto events() { return range_.view(); }
+
+  // each sender completes with every keystroke since the previous one
+  template <std::size_t MaxBatch>
+  auto event_batches() {
+    return range_.template batches<MaxBatch>();
+  }
 };
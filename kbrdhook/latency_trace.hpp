@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+// time from the keyboard hook firing to each later stage of a keystroke.
+//
+// each stage keeps the most recent samples in a preallocated ring, so
+// marking is one fetch_add and one relaxed store, with no allocation.
+struct latency_trace {
+  enum stage : std::size_t {
+    // sender_range::dispatch was called with the event, after the hop from
+    // the hook to the drain
+    dispatch,
+    // the clickety coroutine resumed with the event
+    resume,
+    // the click runs on the com thread (or reaches the render thread)
+    schedule,
+    // playback was started
+    play,
+    stage_count
+  };
+
+  static inline constexpr std::size_t samples = 4096;
+
+  // QPC ticks (steady_clock ns elsewhere). a stamp of 0 means the event is
+  // not traced.
+  using stamp_t = std::int64_t;
+
+  static stamp_t now() noexcept {
+#if defined(_WIN32)
+    LARGE_INTEGER ticks;
+    QueryPerformanceCounter(&ticks);
+    return ticks.QuadPart;
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+#endif
+  }
+
+  // stamp_t ticks per second
+  static stamp_t frequency() noexcept {
+#if defined(_WIN32)
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    return frequency.QuadPart;
+#else
+    return 1000000000;
+#endif
+  }
+
+  static latency_trace& instance() noexcept {
+    static latency_trace trace;
+    return trace;
+  }
+
+  static void mark(stage s, stamp_t hookTime) noexcept {
+    if (hookTime == 0) {
+      return;
+    }
+    auto& ring = instance().stages_[s];
+    auto index = ring.count_.fetch_add(1, std::memory_order_relaxed);
+    ring.ticks_[index % samples].store(
+        now() - hookTime, std::memory_order_relaxed);
+  }
+
+  // p50/p99/max per stage of the samples currently in the rings
+  void print_summary() const {
+    const auto ticksPerSecond = frequency();
+    auto micros = [&](stamp_t ticks) {
+      return (double)ticks * 1000000.0 / (double)ticksPerSecond;
+    };
+
+    static constexpr const char* names[stage_count] = {
+        "dispatch", "resume", "schedule", "play"};
+    printf("latency since hook (us):   count      p50      p99      max\n");
+    std::vector<stamp_t> sorted;
+    sorted.reserve(samples);
+    for (std::size_t s = 0; s != stage_count; ++s) {
+      auto& ring = stages_[s];
+      auto count = ring.count_.load(std::memory_order_relaxed);
+      sorted.clear();
+      for (std::size_t i = 0; i != std::min(count, samples); ++i) {
+        sorted.push_back(ring.ticks_[i].load(std::memory_order_relaxed));
+      }
+      if (sorted.empty()) {
+        printf("  %-22s %8zu\n", names[s], count);
+        continue;
+      }
+      std::sort(sorted.begin(), sorted.end());
+      auto at = [&](double p) {
+        return sorted[(std::size_t)(p * (double)(sorted.size() - 1))];
+      };
+      printf(
+          "  %-22s %8zu %8.0f %8.0f %8.0f\n",
+          names[s],
+          count,
+          micros(at(0.50)),
+          micros(at(0.99)),
+          micros(sorted.back()));
+    }
+    fflush(stdout);
+  }
+
+private:
+  struct stage_ring {
+    std::array<std::atomic<stamp_t>, samples> ticks_{};
+    std::atomic<std::size_t> count_{0};
+  };
+  std::array<stage_ring, stage_count> stages_;
+};
+
+// events that sender_range::dispatch marks from their hookTime_. key_event
+// opts in, the mouse and window events of input_hub are not traced.
+template <typename Event>
+inline constexpr bool latency_traced_v = false;
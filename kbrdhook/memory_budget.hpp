@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include "cache_line.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+
+// the bytes held by each component of the process, with an optional hard
+// cap per component.
+//
+// memory that is set aside up front (pools, buffers) is charged
+// unconditionally and counts against the cap, so that what may grow later
+// is refused once the component is at its cap:
+//
+//   memory_budget::instance().set_limit(memory_budget::clicks, 64 * 1024);
+//   ...
+//   if (!memory_budget::instance().try_reserve(memory_budget::clicks, n)) {
+//     // at the cap, drop the work instead of allocating
+//   }
+//   ...
+//   memory_budget::instance().release(memory_budget::clicks, n);
+//
+// the accounts are process wide, like latency_trace. memory allocated
+// inside the system (MFPlay media items, WASAPI buffers) is not seen here.
+struct memory_budget {
+  enum component : std::size_t {
+    // coroutine frames from frame_pool, pooled and from the heap
+    frames,
+    // operations spawned by Player::Click through its spawn_pool
+    clicks,
+    // Player voices, their callbacks and the decoded click sample
+    voices,
+    // sender_range objects with their buffers, hook rings
+    ranges,
+    component_count
+  };
+
+  struct component_stats {
+    std::size_t used_;
+    std::size_t peak_;
+    // 0 when the component has no cap
+    std::size_t limit_;
+    // reservations that would have gone over the cap
+    std::size_t refused_;
+  };
+
+  static memory_budget& instance() noexcept {
+    static memory_budget budget;
+    return budget;
+  }
+
+  // 0 removes the cap. a cap below what is in use refuses the next
+  // reservation, nothing is taken back.
+  void set_limit(component c, std::size_t bytes) noexcept {
+    accounts_[c].limit_.store(bytes, std::memory_order_relaxed);
+  }
+
+  // false, and nothing is reserved, when bytes would take c over its cap
+  [[nodiscard]] bool try_reserve(component c, std::size_t bytes) noexcept {
+    auto& account = accounts_[c];
+    const auto limit = account.limit_.load(std::memory_order_relaxed);
+    auto used = account.used_.load(std::memory_order_relaxed);
+    do {
+      if (limit != 0 && used + bytes > limit) {
+        account.refused_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+    } while (!account.used_.compare_exchange_weak(
+        used, used + bytes, std::memory_order_relaxed));
+    _raise_peak(account, used + bytes);
+    return true;
+  }
+
+  // for memory that is needed whatever the cap, e.g. set aside at startup
+  void charge(component c, std::size_t bytes) noexcept {
+    auto& account = accounts_[c];
+    const auto used =
+        account.used_.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    _raise_peak(account, used);
+  }
+
+  void release(component c, std::size_t bytes) noexcept {
+    accounts_[c].used_.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  component_stats stats(component c) const noexcept {
+    auto& account = accounts_[c];
+    return {
+        account.used_.load(std::memory_order_relaxed),
+        account.peak_.load(std::memory_order_relaxed),
+        account.limit_.load(std::memory_order_relaxed),
+        account.refused_.load(std::memory_order_relaxed)};
+  }
+
+  // bytes in use by every component
+  std::size_t used() const noexcept {
+    std::size_t total = 0;
+    for (auto& account : accounts_) {
+      total += account.used_.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  void print_summary() const {
+    static constexpr const char* names[component_count] = {
+        "frames", "clicks", "voices", "ranges"};
+    printf("memory (bytes):          used       peak      limit  refused\n");
+    for (std::size_t c = 0; c != component_count; ++c) {
+      auto s = stats((component)c);
+      if (s.limit_ == 0) {
+        printf(
+            "  %-16s %10zu %10zu %10s %8zu\n",
+            names[c],
+            s.used_,
+            s.peak_,
+            "-",
+            s.refused_);
+      } else {
+        printf(
+            "  %-16s %10zu %10zu %10zu %8zu\n",
+            names[c],
+            s.used_,
+            s.peak_,
+            s.limit_,
+            s.refused_);
+      }
+    }
+    printf("  %-16s %10zu\n", "total", used());
+    fflush(stdout);
+  }
+
+private:
+  // reserved from any thread, each on a line of its own
+  struct alignas(cache_line_size) account {
+    std::atomic<std::size_t> used_{0};
+    std::atomic<std::size_t> peak_{0};
+    std::atomic<std::size_t> limit_{0};
+    std::atomic<std::size_t> refused_{0};
+  };
+
+  static void _raise_peak(account& a, std::size_t used) noexcept {
+    auto peak = a.peak_.load(std::memory_order_relaxed);
+    while (used > peak &&
+           !a.peak_.compare_exchange_weak(
+               peak, used, std::memory_order_relaxed)) {
+    }
+  }
+
+  std::array<account, component_count> accounts_;
+};
+
+// charges a fixed amount to a component for as long as it lives, e.g. the
+// footprint of a member that is sized at compile time
+class memory_charge {
+public:
+  memory_charge(memory_budget::component c, std::size_t bytes) noexcept
+    : component_(c)
+    , bytes_(bytes) {
+    memory_budget::instance().charge(component_, bytes_);
+  }
+  ~memory_charge() { memory_budget::instance().release(component_, bytes_); }
+  memory_charge(const memory_charge&) = delete;
+
+private:
+  memory_budget::component component_;
+  std::size_t bytes_;
+};
@@ -0,0 +1,235 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "player.hpp"
+
+#pragma comment(lib, "mfplay.lib")
+#include <Shlwapi.h>
+#include <mferror.h>
+#include <shobjidl.h>  // defines IFileOpenDialog
+#pragma comment(lib, "shlwapi.lib")
+#include <strsafe.h>
+
+#include <cstdio>
+#include <new>
+#include <utility>
+
+class Player::MediaPlayerCallback : public IMFPMediaPlayerCallback {
+  size_t id_;
+  Player* player_;
+  long m_cRef;  // Reference count
+
+public:
+  explicit MediaPlayerCallback(Player* player, size_t id)
+    : id_(id)
+    , player_(player)
+    , m_cRef(1) {}
+
+  STDMETHODIMP QueryInterface(REFIID riid, void** ppv) {
+    static const QITAB qit[] = {
+        QITABENT(MediaPlayerCallback, IMFPMediaPlayerCallback),
+        {0},
+    };
+    return QISearch(this, qit, riid, ppv);
+  }
+  STDMETHODIMP_(ULONG) AddRef() { return InterlockedIncrement(&m_cRef); }
+  STDMETHODIMP_(ULONG) Release() {
+    ULONG count = InterlockedDecrement(&m_cRef);
+    if (count == 0) {
+      delete this;
+      return 0;
+    }
+    return count;
+  }
+
+  // IMFPMediaPlayerCallback methods
+  void STDMETHODCALLTYPE OnMediaPlayerEvent(MFP_EVENT_HEADER* pEventHeader) {
+    if (FAILED(pEventHeader->hrEvent)) {
+      player_->ShowErrorMessage(L"Playback error", pEventHeader->hrEvent);
+      return;
+    }
+
+    switch (pEventHeader->eEventType) {
+      case MFP_EVENT_TYPE_MEDIAITEM_CREATED: {
+        auto* pEvent = MFP_GET_MEDIAITEM_CREATED_EVENT(pEventHeader);
+        auto pMediaItem = pEvent->pMediaItem;
+        // The media item was created successfully.
+        player_->players_[id_].ItemCreated(player_, pMediaItem);
+      } break;
+
+      case MFP_EVENT_TYPE_MEDIAITEM_SET:
+        // set completed
+        player_->players_[id_].ItemSet(player_);
+        break;
+
+      case MFP_EVENT_TYPE_PLAY:
+        // playback has started, the end of the traced latency
+        player_->players_[id_].Played();
+        break;
+
+      case MFP_EVENT_TYPE_PLAYBACK_ENDED:
+        // the voice is free again
+        player_->players_[id_].Ended();
+        break;
+    }
+  }
+};
+
+void Player::player::start(Player* player, size_t id) {
+  HRESULT hr = S_OK;
+
+  id_ = id;
+  pCallback_ = new (std::nothrow) MediaPlayerCallback{player, id_};
+  if (!pCallback_) {
+    std::terminate();
+  }
+  memory_budget::instance().charge(
+      memory_budget::voices, sizeof(MediaPlayerCallback));
+
+  hr = MFPCreateMediaPlayer(
+      NULL,
+      FALSE,       // Start playback automatically?
+      0,           // Flags
+      pCallback_,  // Callback pointer
+      NULL,        // Video window
+      &pPlayer_);
+  if (FAILED(hr)) {
+    std::terminate();
+  }
+
+  if (player->sample_.loaded()) {
+    // Create a new media item over the shared, decoded sample.
+    IMFByteStream* pByteStream = nullptr;
+    hr = player->sample_.open_stream(&pByteStream);
+    if (SUCCEEDED(hr)) {
+      hr = pPlayer_->CreateMediaItemFromObject(pByteStream, FALSE, 0, NULL);
+      pByteStream->Release();
+    }
+  } else {
+    // Create a new media item for this URL.
+    hr = pPlayer_->CreateMediaItemFromURL(
+        L"https://webwit.nl/input/kbsim/mp3/1_.mp3", FALSE, 0, NULL);
+  }
+  if (FAILED(hr)) {
+    std::terminate();
+  }
+  printf("player started\n");
+  fflush(stdout);
+}
+
+void Player::player::destroy() {
+  if (!!pPlayer_) {
+    std::exchange(pPlayer_, nullptr)->Release();
+  }
+  if (!!pCallback_) {
+    std::exchange(pCallback_, nullptr)->Release();
+    memory_budget::instance().release(
+        memory_budget::voices, sizeof(MediaPlayerCallback));
+    printf("player exit\n");
+    fflush(stdout);
+  }
+}
+
+void Player::player::Click(size_t click, latency_trace::stamp_t hookTime) {
+  HRESULT hr = S_OK;
+  if (playing_) {
+    // steal this voice, restart from the beginning
+    hr = pPlayer_->Stop();
+    if (FAILED(hr)) {
+      std::terminate();
+    }
+  }
+  hr = pPlayer_->Play();
+  if (FAILED(hr)) {
+    std::terminate();
+  }
+  playing_ = true;
+  startedAt_ = click;
+  // a stolen voice that had not started drops the older stamp
+  playHookTime_ = hookTime;
+}
+
+void Player::player::ItemCreated(Player* player, IMFPMediaItem* pMediaItem) {
+  HRESULT hr = S_OK;
+
+  // The media item was created successfully.
+
+  if (pPlayer_) {
+    // Set the media item on the player. This method completes
+    // asynchronously.
+    hr = pPlayer_->SetMediaItem(pMediaItem);
+  }
+
+  if (FAILED(hr)) {
+    player->ShowErrorMessage(L"Error playing this file.", hr);
+  }
+}
+
+void Player::player::ItemSet(Player* player) {
+  if (player->ready_.fetch_add(1) + 1 == player->players_.size()) {
+    player->playersReady_.set();
+  }
+}
+
+void Player::Click(latency_trace::stamp_t hookTime) {
+  if (!clickPool_.spawn_pooled(hookTime)) {
+    // the pool is at the cap of memory_budget::clicks, a click that is
+    // this late would not be heard in time anyway
+    droppedClicks_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void Player::_click(latency_trace::stamp_t hookTime) noexcept {
+  latency_trace::mark(latency_trace::schedule, hookTime);
+  // play is marked when MFPlay reports that playback started
+  NextVoice().Click(++clicks_, hookTime);
+}
+
+Player::player& Player::NextVoice() {
+  // only uiLoop_ writes current_
+  const size_t count = players_.size();
+  const size_t current = current_.load(std::memory_order_relaxed);
+  for (size_t i = 0; i != count; ++i) {
+    size_t id = (current + i) % count;
+    if (!players_[id].playing_) {
+      current_.store((id + 1) % count, std::memory_order_relaxed);
+      return players_[id];
+    }
+  }
+  size_t oldest = current;
+  for (size_t id = 0; id != count; ++id) {
+    if (players_[id].startedAt_ < players_[oldest].startedAt_) {
+      oldest = id;
+    }
+  }
+  current_.store((oldest + 1) % count, std::memory_order_relaxed);
+  return players_[oldest];
+}
+
+void Player::ShowErrorMessage(PCWSTR format, HRESULT hrErr) {
+  if (!errorPool_.spawn_pooled(format, hrErr)) {
+    droppedErrors_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void Player::LogErrorMessage(PCWSTR format, HRESULT hrErr) {
+  WCHAR str[MAX_PATH];
+  if (SUCCEEDED(
+          StringCbPrintfW(str, sizeof(str), L"%s (hr=0x%X)", format, hrErr))) {
+    printf("player error: %S\n", str);
+    fflush(stdout);
+  }
+}
@@ -17,209 +17,202 @@
 #pragma once
 
 #include <unifex/async_manual_reset_event.hpp>
-#include <unifex/async_scope.hpp>
 #include <unifex/just_from.hpp>
 #include <unifex/manual_event_loop.hpp>
 #include <unifex/scheduler_concepts.hpp>
-#include <unifex/scope_guard.hpp>
 #include <unifex/sender_concepts.hpp>
 #include <unifex/sequence.hpp>
 
+#include "cache_line.hpp"
+#include "click_sample.hpp"
 #include "com_thread.hpp"
+#include "iocp_context.hpp"
+#include "latency_trace.hpp"
+#include "memory_budget.hpp"
+#include "spawn_pool.hpp"
 
-#include <mfplay.h>
 #include <windows.h>
-#include <windowsx.h>
-#include <winuser.h>
-#pragma comment(lib, "mfplay.lib")
-#include <Shlwapi.h>
-#include <mferror.h>
-#include <shobjidl.h>  // defines IFileOpenDialog
-#pragma comment(lib, "shlwapi.lib")
-#include <strsafe.h>
+#include <mfplay.h>
 
-struct Player {
-  class MediaPlayerCallback : public IMFPMediaPlayerCallback {
-    size_t id_;
-    Player* player_;
-    long m_cRef;  // Reference count
-
-  public:
-    explicit MediaPlayerCallback(Player* player, size_t id)
-      : id_(id)
-      , player_(player)
-      , m_cRef(1) {}
-
-    STDMETHODIMP QueryInterface(REFIID riid, void** ppv) {
-      static const QITAB qit[] = {
-          QITABENT(MediaPlayerCallback, IMFPMediaPlayerCallback),
-          {0},
-      };
-      return QISearch(this, qit, riid, ppv);
-    }
-    STDMETHODIMP_(ULONG) AddRef() { return InterlockedIncrement(&m_cRef); }
-    STDMETHODIMP_(ULONG) Release() {
-      ULONG count = InterlockedDecrement(&m_cRef);
-      if (count == 0) {
-        delete this;
-        return 0;
-      }
-      return count;
-    }
+#include <atomic>
+#include <utility>
+#include <vector>
 
-    // IMFPMediaPlayerCallback methods
-    void STDMETHODCALLTYPE OnMediaPlayerEvent(MFP_EVENT_HEADER* pEventHeader) {
-      if (FAILED(pEventHeader->hrEvent)) {
-        player_->ShowErrorMessage(L"Playback error", pEventHeader->hrEvent);
-        return;
-      }
-
-      switch (pEventHeader->eEventType) {
-        case MFP_EVENT_TYPE_MEDIAITEM_CREATED: {
-          auto* pEvent = MFP_GET_MEDIAITEM_CREATED_EVENT(pEventHeader);
-          auto pMediaItem = pEvent->pMediaItem;
-          // The media item was created successfully.
-          player_->players_[id_].ItemCreated(player_, pMediaItem);
-        } break;
-
-        case MFP_EVENT_TYPE_MEDIAITEM_SET:
-          // set completed
-          player_->players_[id_].ItemSet(player_);
-          break;
-      }
-    }
-  };
+struct Player {
+  // receives the MFPlay events of one voice
+  class MediaPlayerCallback;
 
   struct player {
     ~player() { destroy(); }
-    player() : id_(-1), pCallback_(nullptr), pPlayer_(nullptr) {}
-    void start(Player* player, size_t id) {
-      HRESULT hr = S_OK;
-
-      id_ = id;
-      pCallback_ = new (std::nothrow) MediaPlayerCallback{player, id_};
-
-      hr = MFPCreateMediaPlayer(
-          NULL,
-          FALSE,       // Start playback automatically?
-          0,           // Flags
-          pCallback_,  // Callback pointer
-          NULL,        // Video window
-          &pPlayer_);
-      if (FAILED(hr)) {
-        std::terminate();
-      }
-
-      // Create a new media item for this URL.
-      hr = pPlayer_->CreateMediaItemFromURL(
-          L"https://webwit.nl/input/kbsim/mp3/1_.mp3", FALSE, 0, NULL);
-      if (FAILED(hr)) {
-        std::terminate();
-      }
-      printf("player started\n");
-      fflush(stdout);
-    }
-
-    void destroy() {
-      if (!!pPlayer_) {
-        std::exchange(pPlayer_, nullptr)->Release();
-      }
-      if (!!pCallback_) {
-        std::exchange(pCallback_, nullptr)->Release();
-        printf("player exit\n");
-        fflush(stdout);
-      }
-    }
-
-    void Click() {
-      HRESULT hr = pPlayer_->Stop();
-      if (FAILED(hr)) {
-        std::terminate();
-      }
-      hr = pPlayer_->Play();
-      if (FAILED(hr)) {
-        std::terminate();
-      }
-    }
-
-    void ItemCreated(Player* player, IMFPMediaItem* pMediaItem) {
-      HRESULT hr = S_OK;
-
-      // The media item was created successfully.
-
-      if (pPlayer_) {
-        // Set the media item on the player. This method completes
-        // asynchronously.
-        hr = pPlayer_->SetMediaItem(pMediaItem);
-      }
-
-      if (FAILED(hr)) {
-        player->ShowErrorMessage(L"Error playing this file.", hr);
-      }
-    }
-
-    void ItemSet(Player* player) {
-      if (++player->ready_ == player->players_.size()) {
-        player->playersReady_.set();
-      }
+    player()
+      : id_(-1)
+      , pCallback_(nullptr)
+      , pPlayer_(nullptr)
+      , playing_(false)
+      , startedAt_(0)
+      , playHookTime_(0) {}
+    player(const player&) = delete;
+    void start(Player* player, size_t id);
+    void destroy();
+
+    void Click(size_t click, latency_trace::stamp_t hookTime);
+    void Played() {
+      latency_trace::mark(
+          latency_trace::play, std::exchange(playHookTime_, 0));
     }
+    void Ended() { playing_ = false; }
+    void ItemCreated(Player* player, IMFPMediaItem* pMediaItem);
+    void ItemSet(Player* player);
 
     size_t id_;
     IMFPMediaPlayerCallback* pCallback_;  // Application callback object.
     IMFPMediaPlayer* pPlayer_;            // The MFPlay player object.
+    bool playing_;      // false once playback has ended
+    size_t startedAt_;  // the click that last started this voice
+    // stamp of the click waiting for MFP_EVENT_TYPE_PLAY, 0 once marked
+    latency_trace::stamp_t playHookTime_;
   };
   using scheduler_t = decltype(std::declval<com_thread>().get_scheduler());
+  using worker_scheduler_t =
+      decltype(std::declval<iocp_context>().get_scheduler());
+
+  // the work of one click, on uiLoop_
+  struct click_work {
+    Player* self_;
+    void operator()(latency_trace::stamp_t hookTime) noexcept {
+      self_->_click(hookTime);
+    }
+  };
+  using click_pool_t =
+      spawn_pool<scheduler_t, click_work, latency_trace::stamp_t>;
 
+  // writes an error to the console, on a worker
+  struct error_work {
+    void operator()(PCWSTR format, HRESULT hrErr) noexcept {
+      LogErrorMessage(format, hrErr);
+    }
+  };
+  using error_pool_t =
+      spawn_pool<worker_scheduler_t, error_work, PCWSTR, HRESULT>;
+
+  // MFPlay objects and their callbacks
   scheduler_t uiLoop_;
-  std::array<player, 1> players_;
-  size_t current_;
-  unifex::async_scope scope_;
-  size_t ready_;
+  // decoding the sample
+  worker_scheduler_t worker_;
+  // one voice per click that may overlap with the others
+  std::vector<player> players_;
+  // the voice after the one that played last. written by each click on
+  // uiLoop_, may be read from any thread.
+  alignas(cache_line_size) std::atomic<size_t> current_;
+  size_t clicks_;
+  // the clicks in flight, without an allocation each. grows within the cap
+  // of memory_budget::clicks and shrinks when no click is in flight.
+  click_pool_t clickPool_;
+  // clicks refused at the memory cap
+  std::atomic<size_t> droppedClicks_;
+  // errors waiting for the console, a few without an allocation each
+  error_pool_t errorPool_;
+  // errors refused at the memory cap or after destroy()
+  std::atomic<size_t> droppedErrors_;
+  // the voices themselves, their MFPlay objects are not counted
+  memory_charge voicesCharge_;
+  // voices that have loaded, counted by their callbacks
+  alignas(cache_line_size) std::atomic<size_t> ready_;
   unifex::async_manual_reset_event playersReady_;
-
-  explicit Player(scheduler_t uiLoop)
+  // when set, the sample is decoded once from this file and shared by all
+  // the voices instead of each voice streaming the url
+  PCWSTR samplePath_;
+  click_sample sample_;
+
+  explicit Player(
+      scheduler_t uiLoop,
+      worker_scheduler_t worker,
+      size_t voices = 4,
+      PCWSTR samplePath = nullptr,
+      size_t clicksInFlight = 64)
     : uiLoop_(uiLoop)
+    , worker_(worker)
+    , players_(voices)
     , current_(0)
-    , ready_(0) {}
+    , clicks_(0)
+    , clickPool_(
+          uiLoop, click_work{this}, clicksInFlight, memory_budget::clicks)
+    , droppedClicks_(0)
+    , errorPool_(worker, error_work{}, 4, memory_budget::voices)
+    , droppedErrors_(0)
+    , voicesCharge_(memory_budget::voices, voices * sizeof(player))
+    , ready_(0)
+    , samplePath_(samplePath) {
+    if (voices == 0) {
+      std::terminate();
+    }
+  }
 
+  // the sample is decoded on a worker, then all the voices load in
+  // parallel. this completes when the last is ready.
   auto start() {
     return unifex::sequence(
+        unifex::schedule(worker_),
+        unifex::just_from([this]() {
+          if (!!samplePath_ && FAILED(sample_.load_file(samplePath_))) {
+            printf("failed to load click sample %S\n", samplePath_);
+            std::terminate();
+          }
+        }),
         unifex::schedule(uiLoop_),
         unifex::just_from([this]() {
-          for (auto& p : players_) {
-            p.start(this, current_++ % players_.size());
+          for (size_t id = 0; id < players_.size(); ++id) {
+            players_[id].start(this, id);
           }
         }),
         playersReady_.async_wait());
   }
 
+  // the voices are torn down once the last click has played, and the
+  // summary is written once the last error has been
   [[nodiscard]] auto destroy() {
     return unifex::sequence(
+        clickPool_.drained(),
         unifex::schedule(uiLoop_),
         unifex::just_from([this]() {
           for (auto& p : players_) {
             p.destroy();
           }
+          sample_.reset();
         }),
-        scope_.complete());
+        errorPool_.drained(),
+        unifex::just_from([this]() {
+          printf(
+              "player clicks: %zu, %zu grew the pool, %zu dropped at the "
+              "memory cap, %zu errors not logged\n",
+              clicks_,
+              clickPool_.exhausted() - clickPool_.refused(),
+              droppedClicks_.load(),
+              droppedErrors_.load());
+          fflush(stdout);
+        }));
   }
 
-  void Click() {
-    scope_.spawn_call_on(uiLoop_, [this]() noexcept {
-      players_[++current_ % players_.size()].Click();
-    });
+  void Click(latency_trace::stamp_t hookTime = 0);
+
+  // clicks that found the pool empty and allocated
+  size_t overflowed_clicks() const noexcept {
+    return clickPool_.exhausted() - clickPool_.refused();
   }
 
-  void ShowErrorMessage(PCWSTR format, HRESULT hrErr) {
-    scope_.spawn_call_on(uiLoop_, [this, format, hrErr]() noexcept {
-      HRESULT hr = S_OK;
-      WCHAR str[MAX_PATH];
+  // clicks that were not played because the pool was at the memory cap
+  size_t dropped_clicks() const noexcept { return droppedClicks_.load(); }
 
-      hr = StringCbPrintfW(str, sizeof(str), L"%s (hr=0x%X)", format, hrErr);
+  void _click(latency_trace::stamp_t hookTime) noexcept;
 
-      if (SUCCEEDED(hr)) {
-        MessageBoxW(NULL, str, L"Error", MB_ICONERROR);
-      }
-    });
-  }
+  // round-robin over the free voices, steal the oldest when all are playing
+  player& NextVoice();
+
+  // only hands the error to a worker, which logs it. a message box would be
+  // modal on whichever thread showed it, and even a console write may block
+  // (a full pipe, a QuickEdit selection), while the MFPlay callbacks that
+  // report errors run on the com thread, which must keep pumping the hook.
+  // format must outlive the logging, e.g. a literal.
+  void ShowErrorMessage(PCWSTR format, HRESULT hrErr);
+  static void LogErrorMessage(PCWSTR format, HRESULT hrErr);
 };
\ No newline at end of file
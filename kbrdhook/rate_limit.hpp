@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+
+// adaptors that drop or coalesce events between an event source and a
+// sender_range, so that the events they remove never complete a sender.
+//
+// each adaptor wraps the register function of the source. they compose by
+// wrapping each other, the source calls the innermost one first:
+//
+//   throttle<key_event> repeats{30ms};
+//   debounce<key_event, iocp_context> quiet{timers, 100ms};
+//   auto range = create_event_sender_range<key_event>(
+//       token,
+//       quiet.wrap(repeats.wrap(source.register_fn())),
+//       source.unregister_fn());
+//
+// an adaptor must outlive the range that uses it.
+template <typename Derived, typename EventType>
+struct event_adaptor {
+  using emit_function_t = void (*)(void*, EventType&);
+
+  // given to the wrapped register function in place of the range's
+  // event function
+  struct forwarder {
+    Derived* self_;
+    void operator()(EventType& event) { self_->_on_event(event); }
+  };
+
+  template <typename RegisterFn>
+  auto wrap(RegisterFn inner) noexcept {
+    return [this, inner](auto& fn) noexcept {
+      using fn_t = std::remove_reference_t<decltype(fn)>;
+      emit_ = +[](void* target, EventType& event) {
+        (*static_cast<fn_t*>(target))(event);
+      };
+      target_ = &fn;
+      return inner(forwarder_);
+    };
+  }
+
+  // events that were not passed on
+  std::size_t dropped() const noexcept {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+protected:
+  void _emit(EventType& event) { emit_(target_, event); }
+  void _drop() noexcept { dropped_.fetch_add(1, std::memory_order_relaxed); }
+
+private:
+  emit_function_t emit_{nullptr};
+  void* target_{nullptr};
+  std::atomic<std::size_t> dropped_{0};
+  forwarder forwarder_{static_cast<Derived*>(this)};
+};
+
+// passes an event, then drops the events that follow it within interval.
+// needs no timer, the event is passed on the thread of the source.
+template <typename EventType>
+struct throttle : event_adaptor<throttle<EventType>, EventType> {
+  using clock_t = std::chrono::steady_clock;
+
+  explicit throttle(clock_t::duration interval) : interval_(interval) {}
+  throttle(const throttle&) = delete;
+
+  void _on_event(EventType& event) {
+    const auto now = clock_t::now();
+    if (passed_ && now - passedAt_ < interval_) {
+      this->_drop();
+      return;
+    }
+    passed_ = true;
+    passedAt_ = now;
+    this->_emit(event);
+  }
+
+private:
+  const clock_t::duration interval_;
+  // source thread only
+  bool passed_{false};
+  clock_t::time_point passedAt_{};
+};
+
+// state shared by the adaptors that pass the latest event on a timer. the
+// timer is armed by the first event after an idle period and re-armed from
+// its own expiry, so there is never more than one per adaptor and an event
+// costs no timer operation of its own.
+//
+// Timers is iocp_context or another context with preallocated timers:
+// timer_item, now(), arm(timer_item&, time_point) and disarm(timer_item&).
+template <typename Derived, typename EventType, typename Timers>
+struct timed_event_adaptor : event_adaptor<Derived, EventType> {
+  using time_point = typename Timers::time_point;
+  using duration = typename Timers::clock_t::duration;
+
+  timed_event_adaptor(Timers& timers, duration d)
+    : timers_(timers)
+    , duration_(d)
+    , timer_{{{&_expired}}, this} {}
+  ~timed_event_adaptor() { _close(); }
+  timed_event_adaptor(const timed_event_adaptor&) = delete;
+
+  void _on_event(EventType& event) {
+    std::lock_guard lock{lock_};
+    if (pending_) {
+      // replaced by this one
+      this->_drop();
+    }
+    latest_ = event;
+    pending_ = true;
+    latestAt_ = timers_.now();
+    if (!armed_ && !closing_) {
+      armed_ = true;
+      timers_.arm(timer_, static_cast<Derived*>(this)->_first_due(latestAt_));
+    }
+  }
+
+protected:
+  // stops the timer and waits for it. the derived adaptor calls this
+  // first, so that the timer never runs into a destroyed adaptor.
+  void _close() noexcept {
+    std::unique_lock lock{lock_};
+    closing_ = true;
+    if (armed_) {
+      timers_.disarm(timer_);
+    }
+    // the timer may be running or already posted, it signals once it has
+    // seen closing_
+    idle_.wait(lock, [this]() noexcept { return !armed_; });
+  }
+
+  struct timer : Timers::timer_item {
+    timed_event_adaptor* self_;
+  };
+
+  static void _expired(typename Timers::work_item* work) noexcept {
+    auto& t = *static_cast<timer*>(work);
+    auto* self = static_cast<Derived*>(t.self_);
+    std::unique_lock lock{self->lock_};
+    if (t.cancelled() || self->closing_) {
+      self->_idle();
+      return;
+    }
+    time_point next{};
+    bool rearm = self->_expire(self->timers_.now(), next);
+    if (std::exchange(self->passing_, false)) {
+      // the range is called without the lock, so that a slow consumer
+      // does not hold up the source. the timer is armed again only after
+      // the event is passed on, so there is one emitter at a time.
+      EventType event = self->latest_;
+      lock.unlock();
+      self->_emit(event);
+      lock.lock();
+      if (self->closing_) {
+        self->_idle();
+        return;
+      }
+      if (!rearm && self->pending_) {
+        // arrived while the event was passed on, the timer was not armed
+        // for it
+        next = self->_first_due(self->latestAt_);
+        rearm = true;
+      }
+    }
+    if (rearm) {
+      self->timers_.arm(self->timer_, next);
+    } else {
+      self->_idle();
+    }
+  }
+
+  // lock_ held, the latest event is passed on once the lock is released
+  void _pass() noexcept {
+    pending_ = false;
+    passing_ = true;
+  }
+
+  // lock_ held, the timer is neither pending nor running
+  void _idle() noexcept {
+    armed_ = false;
+    idle_.notify_all();
+  }
+
+  Timers& timers_;
+  const duration duration_;
+  std::mutex lock_;
+  EventType latest_{};
+  // latest_ has not been passed on
+  bool pending_{false};
+  time_point latestAt_{};
+  // _expire() passed latest_ on
+  bool passing_{false};
+  bool closing_{false};
+  // the timer is pending or running
+  bool armed_{false};
+  std::condition_variable idle_;
+  timer timer_;
+};
+
+// passes an event once no other has followed it for quiet, the ones that
+// were followed in time are dropped.
+template <typename EventType, typename Timers>
+struct debounce
+  : timed_event_adaptor<debounce<EventType, Timers>, EventType, Timers> {
+  using base_t =
+      timed_event_adaptor<debounce<EventType, Timers>, EventType, Timers>;
+  using time_point = typename base_t::time_point;
+
+  debounce(Timers& timers, typename base_t::duration quiet)
+    : base_t(timers, quiet) {}
+  ~debounce() { this->_close(); }
+
+  time_point _first_due(time_point at) const noexcept {
+    return at + this->duration_;
+  }
+
+  // returns true to re-arm for next
+  bool _expire(time_point now, time_point& next) {
+    const auto due = this->latestAt_ + this->duration_;
+    if (now < due) {
+      // another event came in, wait for the quiet after it
+      next = due;
+      return true;
+    }
+    this->_pass();
+    return false;
+  }
+};
+
+// passes the latest event once per period while events are arriving. the
+// others in the period are dropped.
+template <typename EventType, typename Timers>
+struct sample
+  : timed_event_adaptor<sample<EventType, Timers>, EventType, Timers> {
+  using base_t =
+      timed_event_adaptor<sample<EventType, Timers>, EventType, Timers>;
+  using time_point = typename base_t::time_point;
+
+  sample(Timers& timers, typename base_t::duration period)
+    : base_t(timers, period) {}
+  ~sample() { this->_close(); }
+
+  time_point _first_due(time_point at) noexcept {
+    periodDue_ = at + this->duration_;
+    return periodDue_;
+  }
+
+  // returns true to re-arm for next
+  bool _expire(time_point, time_point& next) {
+    if (!this->pending_) {
+      // a quiet period, stop until the next event
+      return false;
+    }
+    this->_pass();
+    periodDue_ += this->duration_;
+    next = periodDue_;
+    return true;
+  }
+
+private:
+  time_point periodDue_{};
+};
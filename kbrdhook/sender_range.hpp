@@ -17,6 +17,7 @@
 #pragma once
 
 #include <unifex/detail/atomic_intrusive_queue.hpp>
+#include <unifex/detail/intrusive_queue.hpp>
 
 #include <unifex/create.hpp>
 #include <unifex/scheduler_concepts.hpp>
@@ -24,8 +25,15 @@
 #include <unifex/sender_concepts.hpp>
 #include <unifex/unstoppable_token.hpp>
 
+#include "cache_line.hpp"
+#include "event_buffer.hpp"
+#include "latency_trace.hpp"
+
+#include <atomic>
+#include <concepts>
 #include <optional>
 #include <ranges>
+#include <type_traits>
 
 namespace detail {
 // _conv needed so we can emplace construct non-movable types into
@@ -36,57 +44,281 @@ struct _conv {
   explicit _conv(F f) noexcept : f_((F &&) f) {}
   operator std::invoke_result_t<F>() && { return ((F &&) f_)(); }
 };
+
+// holds F as a base when it is empty (a lambda without captures), so that
+// it takes no space in the object. MSVC ignores [[no_unique_address]], a
+// base works with every compiler.
+template <
+    std::size_t Index,
+    typename F,
+    bool = std::is_empty_v<F> && !std::is_final_v<F>>
+struct _ebo {
+  F f_;
+  explicit _ebo(F f) : f_((F &&) f) {}
+  F& get() noexcept { return f_; }
+};
+template <std::size_t Index, typename F>
+struct _ebo<Index, F, true> : F {
+  explicit _ebo(F f) : F((F &&) f) {}
+  F& get() noexcept { return *this; }
+};
+
+// the function pointer of a type-erased pending operation, left out when
+// the range knows the one type that it completes
+template <typename Function>
+struct _erased_completion {
+  Function complete_with_event_{nullptr};
+};
+struct _direct_completion {};
+
+template <
+    typename Receiver,
+    bool = unifex::
+        is_callable_v<unifex::tag_t<unifex::get_stop_token>, Receiver>>
+struct _event_stop_token {
+  using type = unifex::unstoppable_token;
+  static type get(Receiver&) noexcept { return {}; }
+};
+template <typename Receiver>
+struct _event_stop_token<Receiver, true> {
+  using type = unifex::stop_token_type_t<Receiver>;
+  static type get(Receiver& rec) noexcept {
+    return unifex::get_stop_token(rec);
+  }
+};
 }  // namespace detail
 
+// how sender_range hands an event to the senders that are waiting for it
+enum class delivery_policy {
+  // at most one sender may be pending at a time
+  single_consumer,
+  // every pending sender completes with the event
+  broadcast,
+  // one pending sender completes with the event, the rest keep waiting
+  load_balanced
+};
+
+// the senders of a sender_range may be connected to any receiver. each
+// pending operation brings the function that completes it.
+struct any_receiver {
+  using receiver_type = void;
+  static constexpr std::size_t max_batch = 0;
+};
+
+// every sender of a sender_range is connected to Receiver. MaxBatch is 0
+// for the senders of the range itself, or the MaxBatch of batches<>().
+//
+// the range then knows the type of its pending operations, so dispatch
+// calls their completion directly (and the compiler can inline it) and
+// the operations do not store a function pointer. the senders do not go
+// through unifex::create and only connect to Receiver.
+template <typename Receiver, std::size_t MaxBatch = 0>
+struct known_receiver {
+  using receiver_type = Receiver;
+  static constexpr std::size_t max_batch = MaxBatch;
+};
+
 template <
     typename EventType,
     typename RangeStopToken,
     typename RegisterFn,
-    typename UnregisterFn>
-struct sender_range {
+    typename UnregisterFn,
+    typename BufferPolicy = unbuffered,
+    delivery_policy Delivery = delivery_policy::single_consumer,
+    typename Consumer = any_receiver>
+struct sender_range
+  : private detail::_ebo<0, RegisterFn>
+  , private detail::_ebo<1, UnregisterFn> {
+  using buffer_t = typename BufferPolicy::template buffer_type<EventType>;
   using complete_function_t = void (*)(void*, EventType*) noexcept;
 
-  struct pending_operation {
+  static constexpr bool direct_completion =
+      !std::is_same_v<Consumer, any_receiver>;
+
+  static_assert(
+      Delivery != delivery_policy::broadcast || !buffer_t::enabled,
+      "buffered events can only be delivered to one consumer each");
+
+  struct pending_operation
+    : std::conditional_t<
+          direct_completion,
+          detail::_direct_completion,
+          detail::_erased_completion<complete_function_t>> {
+    pending_operation(void* op, complete_function_t complete) noexcept
+      : pendingOperation_(op) {
+      if constexpr (!direct_completion) {
+        this->complete_with_event_ = complete;
+      }
+    }
+
     void* pendingOperation_;
-    complete_function_t complete_with_event_;
 
     void operator()(EventType* e) {
-      std::exchange(complete_with_event_, nullptr)(
-          std::exchange(pendingOperation_, nullptr), e);
+      if constexpr (direct_completion) {
+        using receiver_t = typename Consumer::receiver_type;
+        using state_t = typename basic_create_sender<known_completion_t>::
+            template state<
+                receiver_t,
+                typename detail::_event_stop_token<receiver_t>::type>;
+        state_t::_complete_with_event(
+            std::exchange(pendingOperation_, nullptr), e);
+      } else {
+        std::exchange(this->complete_with_event_, nullptr)(
+            std::exchange(pendingOperation_, nullptr), e);
+      }
     };
 
     pending_operation* next_{nullptr};
+    // set by the stop callback of this operation
+    std::atomic<bool> stopRequested_{false};
   };
 
+  // the footprint of each pending sender in the range
+  static_assert(
+      sizeof(pending_operation) ==
+          (direct_completion ? 3 : 4) * sizeof(void*),
+      "pending_operation layout changed");
+
+  using pending_queue_t =
+      unifex::intrusive_queue<pending_operation, &pending_operation::next_>;
+
   template <typename State>
   void start(State* state) noexcept {
+    auto epoch = stopEpoch_.load(std::memory_order_acquire);
     if (rangeToken_.stop_requested() ||
         state->eventStopToken_.stop_requested()) {
       unifex::set_done(std::move(state->rec_));
-    } else {
-      (void)pendingOperations_.enqueue(&state->pending_);
+      return;
     }
+    if constexpr (buffer_t::enabled) {
+      // an event arrived while no sender was pending, complete inline
+      if (auto event = buffer_.try_pop()) {
+        state->pending_(&*event);
+        return;
+      }
+    }
+    pending_queue_t pending;
+    pending.push_back(&state->pending_);
+    _requeue(std::move(pending), epoch);
   }
 
   void dispatch(EventType* event) {
-    auto pending = pendingOperations_.dequeue_all();
+    if constexpr (latency_traced_v<EventType>) {
+      latency_trace::mark(latency_trace::dispatch, event->hookTime_);
+    }
+    if constexpr (buffer_t::enabled) {
+      // buffer first so that events are delivered in order
+      buffer_.push(*event);
+      _drain();
+    } else {
+      [[maybe_unused]] auto epoch =
+          stopEpoch_.load(std::memory_order_acquire);
+      auto pending = pendingOperations_.dequeue_all();
 
-    if (pending.empty()) {
-      // no pending operations to complete, discard this event
-      return;
+      if (pending.empty()) {
+        // no pending operations to complete, discard this event
+        return;
+      }
+
+      if constexpr (Delivery == delivery_policy::single_consumer) {
+        auto& complete = *pending.pop_front();
+        if (!pending.empty()) {
+          // more than one pending operation - bug in sender_range usage (do
+          // not start a sender from the range until the previous sender has
+          // completed.)
+          std::terminate();
+        }
+
+        complete(event);
+      } else if constexpr (Delivery == delivery_policy::broadcast) {
+        while (!pending.empty()) {
+          // each consumer gets its own copy to move from
+          EventType copy = *event;
+          (*pending.pop_front())(&copy);
+        }
+      } else {
+        (*pending.pop_front())(event);
+        _requeue(std::move(pending), epoch);
+      }
     }
+  }
+
+  // called from the stop callback of a pending operation
+  void stop_pending(pending_operation& op) noexcept {
+    op.stopRequested_.store(true, std::memory_order_release);
+    stopEpoch_.fetch_add(1, std::memory_order_acq_rel);
+    stop_pending();
+  }
 
-    auto& complete = *pending.pop_front();
-    if (!pending.empty()) {
-      // more than one pending operation - bug in sender_range usage (do not
-      // start a sender from the range until the previous sender has completed.)
-      std::terminate();
+  // completes the operations that were asked to stop with done
+  void stop_pending() noexcept {
+    auto epoch = stopEpoch_.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    _requeue(pendingOperations_.dequeue_all(), epoch);
+  }
+
+  // completes every pending operation with done
+  void stop_all_pending() noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    auto pending = pendingOperations_.dequeue_all();
+    while (!pending.empty()) {
+      (*pending.pop_front())(nullptr);
     }
+  }
 
-    complete(event);
+  // puts dequeued operations back, except those that were asked to stop.
+  //
+  // a stop request that arrives while the operations are dequeued finds
+  // nothing to complete. epoch is the stop epoch from before the dequeue;
+  // the fence pairs with the one in stop_pending() so that either the stop
+  // request sees the operation again or this sees the new epoch.
+  void _requeue(pending_queue_t pending, std::size_t epoch) noexcept {
+    bool requeued = false;
+    while (!pending.empty()) {
+      auto* op = pending.pop_front();
+      if (rangeToken_.stop_requested() ||
+          op->stopRequested_.load(std::memory_order_acquire)) {
+        (*op)(nullptr);
+      } else {
+        (void)pendingOperations_.enqueue(op);
+        requeued = true;
+      }
+    }
+    if (!requeued) {
+      return;
+    }
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (rangeToken_.stop_requested()) {
+      stop_all_pending();
+    } else if (stopEpoch_.load(std::memory_order_acquire) != epoch) {
+      stop_pending();
+    }
+    if constexpr (buffer_t::enabled) {
+      // an event may have been buffered while the operations were dequeued
+      _drain();
+    }
   }
 
-  void stop_pending() { dispatch(nullptr); }
+  // completes pending operations with buffered events. called by both the
+  // producer (after push) and the consumer (after enqueue). the fences pair
+  // so that at least one of them sees both the event and the operation.
+  void _drain() noexcept {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (buffer_.empty()) {
+      return;
+    }
+    auto epoch = stopEpoch_.load(std::memory_order_acquire);
+    auto pending = pendingOperations_.dequeue_all();
+    while (!pending.empty()) {
+      auto event = buffer_.try_pop();
+      if (!event) {
+        break;
+      }
+      (*pending.pop_front())(&*event);
+    }
+    // the buffer ran dry, return the operations that are still waiting
+    _requeue(std::move(pending), epoch);
+  }
 
   struct event_function {
     sender_range* range_;
@@ -99,7 +331,8 @@ struct sender_range {
 
   using registration_t = unifex::callable_result_t<RegisterFn, event_function&>;
 
-  struct create_sender {
+  // completes a sender with the event
+  struct one_event {
     template <
         template <typename...>
         class Variant,
@@ -107,6 +340,55 @@ struct sender_range {
         class Tuple>
     using value_types = Variant<Tuple<EventType>>;
 
+    template <typename Receiver>
+    static void complete(sender_range*, Receiver& rec, EventType& event) {
+      unifex::set_value(std::move(rec), std::move(event));
+    }
+  };
+
+  // completes a sender with the event and as many buffered events as fit
+  template <std::size_t MaxBatch>
+  struct batch_of_events {
+    using batch_t = event_batch<EventType, MaxBatch>;
+
+    template <
+        template <typename...>
+        class Variant,
+        template <typename...>
+        class Tuple>
+    using value_types = Variant<Tuple<batch_t>>;
+
+    template <typename Receiver>
+    static void complete(sender_range* range, Receiver& rec, EventType& event) {
+      batch_t batch;
+      batch.push_back(event);
+      while (!batch.full()) {
+        auto next = range->buffer_.try_pop();
+        if (!next) {
+          break;
+        }
+        batch.push_back(*next);
+      }
+      unifex::set_value(std::move(rec), std::move(batch));
+    }
+  };
+
+  // the completion of the senders connected to a known_receiver
+  using known_completion_t = std::conditional_t<
+      Consumer::max_batch == 0,
+      one_event,
+      batch_of_events<Consumer::max_batch>>;
+
+  template <typename Completion>
+  struct basic_create_sender {
+    template <
+        template <typename...>
+        class Variant,
+        template <typename...>
+        class Tuple>
+    using value_types =
+        typename Completion::template value_types<Variant, Tuple>;
+
     template <template <typename...> class Variant>
     using error_types = Variant<std::exception_ptr>;
 
@@ -118,7 +400,7 @@ struct sender_range {
       _complete_with_event(void* selfVoid, EventType* event) noexcept {
         auto& self = *reinterpret_cast<state*>(selfVoid);
         if (!!event) {
-          unifex::set_value(std::move(self.rec_), std::move(*event));
+          Completion::complete(self.range_, self.rec_, *event);
         } else {
           unifex::set_done(std::move(self.rec_));
         }
@@ -135,8 +417,10 @@ struct sender_range {
 
       // cancellation of the pending sender
       struct stop_callback {
-        sender_range* range_;
-        void operator()() noexcept { range_->stop_pending(); }
+        state* self_;
+        void operator()() noexcept {
+          self_->range_->stop_pending(self_->pending_);
+        }
       };
       typename EventStopToken::template callback_type<stop_callback> callback_;
 
@@ -144,15 +428,15 @@ struct sender_range {
         : range_(scope)
         , rec_(rec)
         , eventStopToken_(eventStopToken)
-        , pending_({this, &_complete_with_event})
-        , callback_(eventStopToken_, stop_callback{range_}) {
+        , pending_{this, &_complete_with_event}
+        , callback_(eventStopToken_, stop_callback{this}) {
         range_->start(this);
       }
       state(state&&) = delete;
     };
 
     template <typename Receiver>
-    requires unifex::
+    requires (!direct_completion) && unifex::
         is_callable_v<unifex::tag_t<unifex::get_stop_token>, Receiver>
     state<Receiver, unifex::stop_token_type_t<Receiver>>
     operator()(Receiver& rec, sender_range* scope) noexcept {
@@ -160,12 +444,73 @@ struct sender_range {
     }
 
     template <typename Receiver>
-    requires (!unifex::is_callable_v<unifex::tag_t<unifex::get_stop_token>, Receiver>)
+    requires (!direct_completion) && (!unifex::
+        is_callable_v<unifex::tag_t<unifex::get_stop_token>, Receiver>)
     state<Receiver, unifex::unstoppable_token>
     operator()(Receiver& rec, sender_range* scope) noexcept {
       return {scope, rec, unifex::unstoppable_token{}};
     }
   };
+  using create_sender = basic_create_sender<one_event>;
+
+  // the state of basic_create_sender, started in place of unifex::create
+  // so that the receiver is exactly the known one
+  template <typename Completion>
+  struct direct_operation {
+    using receiver_t = typename Consumer::receiver_type;
+    using token_t = detail::_event_stop_token<receiver_t>;
+    using state_t = typename basic_create_sender<Completion>::
+        template state<receiver_t, typename token_t::type>;
+
+    sender_range* range_;
+    receiver_t rec_;
+    std::optional<state_t> state_{};
+
+    direct_operation(sender_range* range, receiver_t rec)
+      : range_(range)
+      , rec_(std::move(rec)) {}
+    direct_operation(direct_operation&&) = delete;
+
+    void start() noexcept {
+      state_.emplace(range_, rec_, token_t::get(rec_));
+    }
+  };
+
+  template <typename Completion>
+  struct direct_sender {
+    template <
+        template <typename...>
+        class Variant,
+        template <typename...>
+        class Tuple>
+    using value_types =
+        typename Completion::template value_types<Variant, Tuple>;
+
+    template <template <typename...> class Variant>
+    using error_types = Variant<std::exception_ptr>;
+
+    static inline constexpr bool sends_done = true;
+
+    sender_range* range_;
+
+    template <typename Receiver>
+    requires std::same_as<
+        std::remove_cvref_t<Receiver>,
+        typename Consumer::receiver_type> &&
+        std::same_as<Completion, known_completion_t>
+    direct_operation<Completion> connect(Receiver&& rec) {
+      return {range_, (Receiver &&) rec};
+    }
+  };
+
+  template <typename Completion>
+  auto _make_sender() {
+    if constexpr (direct_completion) {
+      return direct_sender<Completion>{this};
+    } else {
+      return unifex::create(basic_create_sender<Completion>{}, this);
+    }
+  }
 
   struct stop_callback {
     sender_range* range_;
@@ -176,7 +521,7 @@ struct sender_range {
   // (that uses a lambda)
   static auto make_range(sender_range* self) {
     return std::views::iota(0) | std::views::transform([self](int) {
-             return unifex::create(create_sender{}, self);
+             return self->template _make_sender<one_event>();
            });
   }
 
@@ -185,40 +530,47 @@ struct sender_range {
   RangeType range_;
   // args
   RangeStopToken rangeToken_;
-  RegisterFn registerFn_;
-  UnregisterFn unregisterFn_;
+  // the register and unregister functions are the bases
   // cancellation
   typename RangeStopToken::template callback_type<stop_callback> callback_;
   // tracking result of registerFn
   std::optional<registration_t> registration_;
-  // type-erased registration of a sender waiting for an event
-  unifex::atomic_intrusive_queue<pending_operation, &pending_operation::next_>
-      pendingOperations_;
+  // type-erased registration of a sender waiting for an event. enqueued by
+  // consumers on any thread and drained by the producer, so it is kept off
+  // the lines of the fields above.
+  alignas(cache_line_size) unifex::
+      atomic_intrusive_queue<pending_operation, &pending_operation::next_>
+          pendingOperations_;
+  // bumped by every stop request of a pending operation. read with
+  // pendingOperations_, so it shares the line.
+  std::atomic<std::size_t> stopEpoch_{0};
+  // events that arrived while no operation was pending
+  alignas(cache_line_size) buffer_t buffer_;
   // fixed storage for the fucntion used to emit an event (allows
   // event_function& to have the right lifetime)
   event_function event_function_;
 
   auto _register() noexcept {
     return detail::_conv{[this]() noexcept {
-      return registerFn_(event_function_);
+      return this->detail::_ebo<0, RegisterFn>::get()(event_function_);
     }};
   }
 
   void _unregister() {
     if (!!registration_) {
-      unregisterFn_(registration_.value());
+      this->detail::_ebo<1, UnregisterFn>::get()(registration_.value());
       registration_.reset();
-      stop_pending();
+      stop_all_pending();
     }
   }
 
 public:
   sender_range(
       RangeStopToken token, RegisterFn registerFn, UnregisterFn unregisterFn)
-    : range_(make_range(this))
+    : detail::_ebo<0, RegisterFn>(registerFn)
+    , detail::_ebo<1, UnregisterFn>(unregisterFn)
+    , range_(make_range(this))
     , rangeToken_(token)
-    , registerFn_(registerFn)
-    , unregisterFn_(unregisterFn)
     , callback_(rangeToken_, stop_callback{this})
     , registration_(_register())
     , pendingOperations_()
@@ -236,21 +588,58 @@ public:
     return sender_view{&range_};
   }
 
+  // a sender that completes with all the events buffered since the last
+  // sender completed, up to MaxBatch of them. waits for at least one event.
+  template <std::size_t MaxBatch>
+  auto next_n() requires buffer_t::enabled {
+    return _make_sender<batch_of_events<MaxBatch>>();
+  }
+
+  template <std::size_t MaxBatch>
+  auto batches() requires buffer_t::enabled {
+    return std::views::iota(0) | std::views::transform([this](int) {
+             return next_n<MaxBatch>();
+           });
+  }
+
   auto& get_registration() { return registration_; }
 
+  // number of events lost to the overflow policy of the buffer
+  std::size_t dropped() const noexcept
+      requires buffer_t::enabled {
+    return buffer_.dropped();
+  }
+
   auto begin() noexcept { return range_.begin(); }
   auto end() noexcept { return range_.end(); }
 };
 
 template <
     typename EventType,
+    typename BufferPolicy = unbuffered,
+    delivery_policy Delivery = delivery_policy::single_consumer,
+    typename Consumer = any_receiver,
     typename StopToken,
     typename RegisterFn,
     typename UnregisterFn>
-sender_range<EventType, StopToken, RegisterFn, UnregisterFn>
+sender_range<
+    EventType,
+    StopToken,
+    RegisterFn,
+    UnregisterFn,
+    BufferPolicy,
+    Delivery,
+    Consumer>
 create_event_sender_range(
     StopToken token, RegisterFn&& registerFn, UnregisterFn&& unregisterFn) {
-  using result_t = sender_range<EventType, StopToken, RegisterFn, UnregisterFn>;
+  using result_t = sender_range<
+      EventType,
+      StopToken,
+      RegisterFn,
+      UnregisterFn,
+      BufferPolicy,
+      Delivery,
+      Consumer>;
   using registration_t =
       unifex::callable_result_t<RegisterFn, typename result_t::event_function&>;
 
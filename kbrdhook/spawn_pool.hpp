@@ -0,0 +1,266 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/async_manual_reset_event.hpp>
+#include <unifex/just_from.hpp>
+#include <unifex/manual_lifetime.hpp>
+#include <unifex/receiver_concepts.hpp>
+#include <unifex/scheduler_concepts.hpp>
+#include <unifex/sender_concepts.hpp>
+#include <unifex/sequence.hpp>
+
+#include "memory_budget.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <tuple>
+#include <utility>
+
+// runs fn(args...) on a scheduler without allocating, in place of
+// async_scope::spawn_call_on, which allocates an operation state for each
+// call.
+//
+// capacity slots are allocated by the constructor. spawn_pooled() takes a
+// free slot, connects the schedule() sender into it and starts it, and the
+// slot is free again once fn has returned. when every slot is in flight the
+// pool grows by a slot, charged to the account component of memory_budget.
+// the grown slots are freed again when the pool is next idle. when the
+// component is at its cap spawn_pooled() returns false and counts it, so
+// that the caller can drop the work or wait:
+//
+//   if (!clicks_.spawn_pooled(hookTime)) {
+//     ++dropped_;
+//   }
+//
+// fn runs on the threads of the scheduler, concurrently with itself if the
+// scheduler has more than one. the pool must outlive the work it spawned,
+// drained() completes once that work is done:
+//
+//   sequence(clicks_.drained(), schedule(uiLoop_), just_from(teardown))
+template <typename Scheduler, typename Fn, typename... Args>
+struct spawn_pool {
+  struct slot;
+
+  static inline constexpr std::size_t closed_bit = ~(~std::size_t{0} >> 1);
+
+  struct receiver {
+    slot* slot_;
+
+    void set_value() noexcept { slot_->pool_->_complete(*slot_, true); }
+    void set_done() noexcept { slot_->pool_->_complete(*slot_, false); }
+    void set_error(std::exception_ptr) noexcept { std::terminate(); }
+  };
+
+  using operation_t = unifex::connect_result_t<
+      unifex::schedule_result_t<Scheduler&>,
+      receiver>;
+
+  struct slot {
+    spawn_pool* pool_{nullptr};
+    slot* next_{nullptr};
+    std::tuple<Args...> args_{};
+    // the operation of the last spawn stays constructed until the slot is
+    // reused or the pool is destroyed
+    bool constructed_{false};
+    // allocated beyond capacity, freed when the pool is idle
+    bool grown_{false};
+    unifex::manual_lifetime<operation_t> op_;
+  };
+
+  ~spawn_pool() {
+    if ((inFlight_.load() & ~closed_bit) != 0) {
+      // work outlived its pool
+      std::terminate();
+    }
+    for (std::size_t i = 0; i != capacity_; ++i) {
+      if (slots_[i].constructed_) {
+        slots_[i].op_.destruct();
+      }
+    }
+    _free_grown();
+  }
+  spawn_pool(
+      Scheduler scheduler,
+      Fn fn,
+      std::size_t capacity,
+      memory_budget::component account)
+    : scheduler_(std::move(scheduler))
+    , fn_(std::move(fn))
+    , capacity_(capacity)
+    , account_(account)
+    , charge_(account, sizeof(slot) * capacity)
+    , slots_(new slot[capacity]) {
+    for (std::size_t i = 0; i != capacity_; ++i) {
+      slots_[i].pool_ = this;
+      slots_[i].next_ = free_;
+      free_ = &slots_[i];
+    }
+  }
+  spawn_pool(const spawn_pool&) = delete;
+
+  // returns false when every slot is in flight and the account is at its
+  // cap, or once drained() has started. args are not used then.
+  [[nodiscard]] bool spawn_pooled(Args... args) {
+    if ((inFlight_.fetch_add(1, std::memory_order_acquire) & closed_bit) !=
+        0) {
+      _release();
+      return false;
+    }
+    slot* s = nullptr;
+    {
+      std::lock_guard lock{lock_};
+      s = free_;
+      if (!!s) {
+        free_ = s->next_;
+      }
+    }
+    if (!s) {
+      exhausted_.fetch_add(1, std::memory_order_relaxed);
+      s = _grow();
+      if (!s) {
+        refused_.fetch_add(1, std::memory_order_relaxed);
+        _release();
+        return false;
+      }
+    }
+    if (s->constructed_) {
+      s->op_.destruct();
+    }
+    s->args_ = std::tuple<Args...>{std::move(args)...};
+    s->op_.construct_with([&] {
+      return unifex::connect(unifex::schedule(scheduler_), receiver{s});
+    });
+    s->constructed_ = true;
+    unifex::start(s->op_.get());
+    return true;
+  }
+
+  // spawns that found no free slot
+  std::size_t exhausted() const noexcept {
+    return exhausted_.load(std::memory_order_relaxed);
+  }
+
+  // spawns that found no free slot and were refused by the memory cap
+  std::size_t refused() const noexcept {
+    return refused_.load(std::memory_order_relaxed);
+  }
+
+  // spawns whose fn has not returned yet
+  std::size_t in_flight() const noexcept {
+    return inFlight_.load(std::memory_order_relaxed) & ~closed_bit;
+  }
+
+  // completes once every spawn has returned. spawn_pooled() refuses the
+  // work from the time this starts.
+  [[nodiscard]] auto drained() {
+    return unifex::sequence(
+        unifex::just_from([this]() noexcept {
+          if (inFlight_.fetch_or(closed_bit, std::memory_order_acq_rel) ==
+              0) {
+            drained_.set();
+          }
+        }),
+        // set by the last spawn to return, on the thread it ran on
+        drained_.async_wait());
+  }
+
+private:
+  slot* _grow() noexcept {
+    auto& budget = memory_budget::instance();
+    if (!budget.try_reserve(account_, sizeof(slot))) {
+      return nullptr;
+    }
+    auto* s = new (std::nothrow) slot{};
+    if (!s) {
+      budget.release(account_, sizeof(slot));
+      return nullptr;
+    }
+    s->pool_ = this;
+    s->grown_ = true;
+    grownSlots_.fetch_add(1, std::memory_order_relaxed);
+    return s;
+  }
+
+  // frees the grown slots on the free list
+  void _free_grown() noexcept {
+    slot* remaining = nullptr;
+    for (slot* s = std::exchange(free_, nullptr); !!s;) {
+      slot* next = s->next_;
+      if (s->grown_) {
+        if (s->constructed_) {
+          s->op_.destruct();
+        }
+        delete s;
+        grownSlots_.fetch_sub(1, std::memory_order_relaxed);
+        memory_budget::instance().release(account_, sizeof(slot));
+      } else {
+        s->next_ = remaining;
+        remaining = s;
+      }
+      s = next;
+    }
+    free_ = remaining;
+  }
+
+  void _complete(slot& s, bool run) noexcept {
+    if (run) {
+      std::apply(fn_, s.args_);
+    }
+    {
+      std::lock_guard lock{lock_};
+      if (grownSlots_.load(std::memory_order_relaxed) != 0 &&
+          (inFlight_.load(std::memory_order_acquire) & ~closed_bit) == 1) {
+        // the pool is idle once this returns. s is still completing, it is
+        // not on the free list yet and waits for the next idle.
+        _free_grown();
+      }
+      s.next_ = free_;
+      free_ = &s;
+    }
+    _release();
+  }
+
+  // nothing touches the pool after this, once drained() has started
+  void _release() noexcept {
+    if (inFlight_.fetch_sub(1, std::memory_order_acq_rel) ==
+        (closed_bit | 1)) {
+      drained_.set();
+    }
+  }
+
+  Scheduler scheduler_;
+  Fn fn_;
+  const std::size_t capacity_;
+  const memory_budget::component account_;
+  memory_charge charge_;
+  std::unique_ptr<slot[]> slots_;
+  std::mutex lock_;
+  slot* free_{nullptr};
+  // spawns in flight, plus closed_bit once drained() has started. whoever
+  // leaves only closed_bit sets drained_.
+  std::atomic<std::size_t> inFlight_{0};
+  unifex::async_manual_reset_event drained_;
+  std::atomic<std::size_t> exhausted_{0};
+  std::atomic<std::size_t> refused_{0};
+  // slots allocated beyond capacity that have not been freed yet
+  std::atomic<std::size_t> grownSlots_{0};
+};
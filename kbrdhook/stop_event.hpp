@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/create.hpp>
+#include <unifex/inplace_stop_token.hpp>
+#include <unifex/receiver_concepts.hpp>
+
+namespace detail {
+struct _stop_event {
+  unifex::inplace_stop_source* source_;
+
+  template <
+      template <typename...>
+      class Variant,
+      template <typename...>
+      class Tuple>
+  using value_types = Variant<Tuple<>>;
+  template <template <typename...> class Variant>
+  using error_types = Variant<>;
+  static inline constexpr bool sends_done = false;
+  template <typename Receiver>
+  auto operator()(Receiver& rec) noexcept {
+    auto exit = [&rec]() noexcept {
+      unifex::set_value(rec);
+    };
+    return unifex::inplace_stop_callback<decltype(exit)>{
+        source_->get_token(), exit};
+  }
+};
+}  // namespace detail
+
+// a sender that completes with set_value once source is stopped, on the
+// thread that stops it. the trigger of stop_when(), e.g. for ctrl-C.
+inline auto stop_event(unifex::inplace_stop_source& source) {
+  return unifex::create(detail::_stop_event{&source});
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// reports operations that do not finish within a limit after they were
+// asked to stop, e.g. the shutdown chain from ctrl-C to clickety returning.
+//
+//   auto id = watchdog.begin("shutdown");
+//   ... request_stop() and wait ...
+//   watchdog.end(id);
+//
+// an operation that is still running after limit is printed once, with
+// the output of its describe function if it has one. the watchdog does not
+// interfere with the operation, it only makes a hang visible.
+struct stop_watchdog {
+  using clock_t = std::chrono::steady_clock;
+  using watch_id = std::size_t;
+  // prints the state of a stuck operation
+  using describe_fn = void (*)(void*) noexcept;
+
+  explicit stop_watchdog(clock_t::duration limit)
+    : limit_(limit)
+    , thread_([this]() noexcept { _run(); }) {}
+  ~stop_watchdog() {
+    {
+      std::lock_guard lock{lock_};
+      stopping_ = true;
+    }
+    wake_.notify_one();
+    thread_.join();
+  }
+  stop_watchdog(const stop_watchdog&) = delete;
+
+  // name must outlive the watch (e.g. a string literal)
+  watch_id begin(
+      const char* name,
+      describe_fn describe = nullptr,
+      void* context = nullptr) {
+    std::lock_guard lock{lock_};
+    const watch_id id = nextId_++;
+    watches_.push_back({id, name, describe, context, clock_t::now(), false});
+    return id;
+  }
+
+  // returns how long the operation took to finish
+  clock_t::duration end(watch_id id) {
+    const auto now = clock_t::now();
+    std::lock_guard lock{lock_};
+    auto found = std::find_if(
+        watches_.begin(), watches_.end(), [id](auto& w) {
+          return w.id_ == id;
+        });
+    if (found == watches_.end()) {
+      return {};
+    }
+    const auto took = now - found->startedAt_;
+    if (found->reported_) {
+      printf(
+          "watchdog: %s finished after %lldms\n",
+          found->name_,
+          (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+              took)
+              .count());
+      fflush(stdout);
+    }
+    watches_.erase(found);
+    return took;
+  }
+
+  // operations that have been reported as stuck
+  std::size_t stuck() const noexcept {
+    return stuck_.load(std::memory_order_relaxed);
+  }
+
+private:
+  struct watch {
+    watch_id id_;
+    const char* name_;
+    describe_fn describe_;
+    void* context_;
+    clock_t::time_point startedAt_;
+    bool reported_;
+  };
+
+  void _run() noexcept {
+    std::unique_lock lock{lock_};
+    while (!stopping_) {
+      wake_.wait_for(lock, limit_ / 4);
+      const auto now = clock_t::now();
+      for (auto& w : watches_) {
+        if (w.reported_ || now - w.startedAt_ < limit_) {
+          continue;
+        }
+        w.reported_ = true;
+        stuck_.fetch_add(1, std::memory_order_relaxed);
+        printf(
+            "watchdog: %s has not finished after %lldms\n",
+            w.name_,
+            (long long)std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - w.startedAt_)
+                .count());
+        if (!!w.describe_) {
+          w.describe_(w.context_);
+        }
+        fflush(stdout);
+      }
+    }
+  }
+
+  const clock_t::duration limit_;
+  std::mutex lock_;
+  std::condition_variable wake_;
+  bool stopping_{false};
+  watch_id nextId_{0};
+  std::vector<watch> watches_;
+  std::atomic<std::size_t> stuck_{0};
+  std::thread thread_;
+};
@@ -0,0 +1,194 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <exception>
+#include <random>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// how synthetic_source spaces the events of a script
+enum class replay_pacing {
+  // ignore the delays, emit back to back
+  full_speed,
+  // wait for each delay, measured from the start of the replay
+  scripted
+};
+
+template <typename EventType>
+struct scripted_event {
+  // time since the previous event
+  std::chrono::nanoseconds delay_;
+  EventType event_;
+};
+
+template <typename EventType>
+using event_script = std::vector<scripted_event<EventType>>;
+
+// count events around interval apart, each delay within +/- jitter.
+// makeEvent(i) returns the i-th event.
+template <typename EventType, typename MakeEvent>
+event_script<EventType> generate_script(
+    std::size_t count,
+    std::chrono::nanoseconds interval,
+    std::chrono::nanoseconds jitter,
+    MakeEvent makeEvent,
+    unsigned seed = 1) {
+  std::minstd_rand random{seed};
+  std::uniform_int_distribution<std::chrono::nanoseconds::rep> offset{
+      -jitter.count(), jitter.count()};
+  event_script<EventType> script;
+  script.reserve(count);
+  for (std::size_t i = 0; i != count; ++i) {
+    auto delay = interval + std::chrono::nanoseconds(offset(random));
+    script.push_back(
+        {std::max(delay, std::chrono::nanoseconds::zero()), makeEvent(i)});
+  }
+  return script;
+}
+
+// an event source that replays a script on its own thread. it plugs into
+// create_event_sender_range in place of a platform hook:
+//
+//   synthetic_source<key> source;
+//   auto range = create_event_sender_range<key>(
+//       token, source.register_fn(), source.unregister_fn());
+//   source.start(script, replay_pacing::full_speed);
+//   ...
+//   source.join();
+template <typename EventType>
+struct synthetic_source {
+  using emit_function_t = void (*)(void*, EventType&);
+
+  // returned to sender_range by register_fn()
+  struct registration {
+    synthetic_source* source_;
+  };
+
+  ~synthetic_source() {
+    if (replay_.joinable()) {
+      // must call join()
+      std::terminate();
+    }
+  }
+  synthetic_source() = default;
+  synthetic_source(const synthetic_source&) = delete;
+
+  auto register_fn() noexcept {
+    return [this](auto& fn) noexcept {
+      using fn_t = std::remove_reference_t<decltype(fn)>;
+      emit_ = +[](void* target, EventType& event) {
+        (*static_cast<fn_t*>(target))(event);
+      };
+      target_.store(&fn);
+      return registration{this};
+    };
+  }
+
+  auto unregister_fn() noexcept {
+    return [](registration& r) noexcept { r.source_->_unbind(); };
+  }
+
+  // replays script, which must outlive the replay. prepare(event) runs just
+  // before each event is emitted (e.g. to stamp it) and finished() runs on
+  // the replay thread after the last one.
+  template <typename Prepare, typename Finished>
+  void start(
+      const event_script<EventType>& script,
+      replay_pacing pacing,
+      Prepare prepare,
+      Finished finished) {
+    if (replay_.joinable()) {
+      std::terminate();
+    }
+    emitted_.store(0, std::memory_order_relaxed);
+    replay_ = std::thread([this, &script, pacing, prepare, finished]() mutable {
+      auto due = std::chrono::steady_clock::now();
+      for (auto& step : script) {
+        if (pacing == replay_pacing::scripted) {
+          due += step.delay_;
+          _wait_until(due);
+        }
+        EventType event = step.event_;
+        prepare(event);
+        _emit(event);
+      }
+      finished();
+    });
+  }
+
+  void start(const event_script<EventType>& script, replay_pacing pacing) {
+    start(script, pacing, [](EventType&) noexcept {}, []() noexcept {});
+  }
+
+  void join() {
+    if (replay_.joinable()) {
+      replay_.join();
+    }
+  }
+
+  // events handed to the registered function so far
+  std::size_t emitted() const noexcept {
+    return emitted_.load(std::memory_order_relaxed);
+  }
+
+private:
+  void _emit(EventType& event) {
+    // seq_cst pairs with _unbind(), either this sees no target or _unbind()
+    // waits for this to return
+    emitting_.store(true);
+    if (void* target = target_.load()) {
+      emit_(target, event);
+      emitted_.fetch_add(1, std::memory_order_relaxed);
+    }
+    emitting_.store(false);
+  }
+
+  void _unbind() noexcept {
+    target_.store(nullptr);
+    if (replay_.get_id() == std::this_thread::get_id()) {
+      // stopped from inside an emit
+      return;
+    }
+    while (emitting_.load()) {
+      std::this_thread::yield();
+    }
+  }
+
+  // sleep most of the way, then spin for precision
+  static void _wait_until(std::chrono::steady_clock::time_point due) {
+    using namespace std::chrono_literals;
+    auto remaining = due - std::chrono::steady_clock::now();
+    if (remaining > 2ms) {
+      std::this_thread::sleep_for(remaining - 1ms);
+    }
+    while (std::chrono::steady_clock::now() < due) {
+      std::this_thread::yield();
+    }
+  }
+
+  emit_function_t emit_{nullptr};
+  std::atomic<void*> target_{nullptr};
+  std::atomic<bool> emitting_{false};
+  std::atomic<std::size_t> emitted_{0};
+  std::thread replay_;
+};
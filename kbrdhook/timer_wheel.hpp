@@ -0,0 +1,472 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/get_stop_token.hpp>
+#include <unifex/receiver_concepts.hpp>
+#include <unifex/scheduler_concepts.hpp>
+#include <unifex/sender_concepts.hpp>
+
+#include "iocp_context.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <utility>
+
+// timers for the many short deadlines of debouncing and voice timeouts.
+//
+// deadlines are rounded up to a tick and kept in a hierarchical wheel of
+// four levels of 64 slots, so arming and cancelling a timer is a list
+// insert or unlink under the lock, whatever the number of timers. the
+// wheel is driven by one timer of an iocp_context, armed only while timers
+// are pending and only for the next tick that has work, and all the timers
+// of a tick are posted to the workers together.
+//
+// timers never expire early. they are posted within a tick of their
+// deadline, and then wait for a worker like any other work; timers further
+// out than 64^4 ticks wait in an overflow list.
+struct timer_wheel {
+  using clock_t = iocp_context::clock_t;
+  using time_point = iocp_context::time_point;
+  using work_item = iocp_context::work_item;
+
+  enum class timer_state { idle, queued, cancelled, expired };
+
+  // a pending timer. execute_ runs on a worker of the iocp_context when it
+  // expires or is cancelled.
+  struct timer_item : work_item {
+    time_point due_;
+    timer_state state_{timer_state::idle};
+    timer_item* prev_{nullptr};
+    timer_item* next_{nullptr};
+    // the tick it expires on and the list it is in
+    std::uint64_t tick_{0};
+    timer_item** list_{nullptr};
+
+    bool cancelled() const noexcept {
+      return state_ == timer_state::cancelled;
+    }
+  };
+
+  explicit timer_wheel(
+      iocp_context& context,
+      clock_t::duration tick = std::chrono::milliseconds(1))
+    : context_(context)
+    , tick_(tick)
+    , start_(context.now())
+    , driver_{{{&_drive}}, this} {
+    if (tick_ <= clock_t::duration::zero()) {
+      std::terminate();
+    }
+  }
+  ~timer_wheel() {
+    std::unique_lock lock{lock_};
+    if (pending_ != 0) {
+      // a timer outlived its wheel
+      std::terminate();
+    }
+    closing_ = true;
+    if (driving_) {
+      context_.disarm(driver_);
+    }
+    // the driver may be running or already posted
+    idle_.wait(lock, [this] { return !driving_; });
+  }
+  timer_wheel(const timer_wheel&) = delete;
+
+  time_point now() const noexcept { return context_.now(); }
+
+  // arms a preallocated timer without a sender. the timer must not be
+  // pending.
+  void arm(timer_item& timer, time_point due) noexcept {
+    timer.due_ = due;
+    timer.state_ = timer_state::idle;
+    _insert(timer);
+  }
+
+  // a pending timer is removed and runs as cancelled. a timer that has
+  // already expired runs as expired.
+  void disarm(timer_item& timer) noexcept { _cancel(timer); }
+
+private:
+  static inline constexpr std::size_t levels = 4;
+  static inline constexpr std::size_t slot_bits = 6;
+  static inline constexpr std::size_t slots = std::size_t{1} << slot_bits;
+  static inline constexpr std::uint64_t slot_mask = slots - 1;
+
+  template <typename Receiver>
+  struct timer_operation : timer_item {
+    struct on_stop {
+      timer_operation* op_;
+      void operator()() const noexcept { op_->self_->_cancel(*op_); }
+    };
+    using stop_callback_t = typename unifex::stop_token_type_t<
+        Receiver>::template callback_type<on_stop>;
+
+    timer_wheel* self_;
+    Receiver rec_;
+    std::optional<stop_callback_t> onStop_{};
+
+    timer_operation(timer_wheel* self, time_point due, Receiver rec)
+      : timer_item{{&_execute}, due}
+      , self_(self)
+      , rec_(std::move(rec)) {}
+    timer_operation(timer_operation&&) = delete;
+
+    static void _execute(work_item* work) noexcept {
+      auto& op = *static_cast<timer_operation*>(work);
+      op.onStop_.reset();
+      if (op.cancelled()) {
+        unifex::set_done(std::move(op.rec_));
+      } else {
+        unifex::set_value(std::move(op.rec_));
+      }
+    }
+
+    void start() noexcept {
+      // a stop request from inside emplace() only marks the timer, the
+      // insert below completes it
+      onStop_.emplace(unifex::get_stop_token(rec_), on_stop{this});
+      self_->_insert(*this);
+    }
+  };
+
+  struct timer_sender {
+    template <
+        template <typename...>
+        class Variant,
+        template <typename...>
+        class Tuple>
+    using value_types = Variant<Tuple<>>;
+    template <template <typename...> class Variant>
+    using error_types = Variant<>;
+    static inline constexpr bool sends_done = true;
+
+    timer_wheel* self_;
+    time_point due_;
+
+    template <typename Receiver>
+    timer_operation<Receiver> connect(Receiver rec) {
+      return {self_, due_, std::move(rec)};
+    }
+  };
+
+public:
+  // schedule() goes straight to the iocp_context, the timers go through
+  // the wheel
+  struct _scheduler {
+    timer_wheel* self_;
+    _scheduler() = delete;
+    explicit _scheduler(timer_wheel* self) : self_(self) {}
+    _scheduler(const _scheduler&) = default;
+    _scheduler(_scheduler&&) = default;
+
+    auto schedule() const noexcept {
+      return self_->context_.get_scheduler().schedule();
+    }
+
+    timer_sender schedule_at(time_point due) const noexcept {
+      return {self_, due};
+    }
+
+    template <typename Rep, typename Period>
+    timer_sender
+    schedule_after(std::chrono::duration<Rep, Period> delay) const noexcept {
+      return {
+          self_,
+          self_->now() + std::chrono::duration_cast<clock_t::duration>(delay)};
+    }
+
+    time_point now() const noexcept { return self_->now(); }
+
+    friend bool operator==(_scheduler a, _scheduler b) noexcept {
+      return a.self_ == b.self_;
+    }
+    friend bool operator!=(_scheduler a, _scheduler b) noexcept {
+      return a.self_ != b.self_;
+    }
+  };
+  _scheduler get_scheduler() { return _scheduler{this}; }
+
+private:
+  struct driver : iocp_context::timer_item {
+    timer_wheel* self_;
+  };
+
+  // the first tick at or after due
+  std::uint64_t _tick_of(time_point due) const noexcept {
+    if (due <= start_) {
+      return 0;
+    }
+    return (std::uint64_t)((due - start_ + tick_ - clock_t::duration(1)) /
+                           tick_);
+  }
+
+  // the last tick at or before at
+  std::uint64_t _ticks_until(time_point at) const noexcept {
+    if (at <= start_) {
+      return 0;
+    }
+    return (std::uint64_t)((at - start_) / tick_);
+  }
+
+  void _insert(timer_item& timer) noexcept {
+    bool post = false;
+    {
+      std::lock_guard lock{lock_};
+      if (timer.state_ == timer_state::cancelled) {
+        post = true;
+      } else {
+        timer.state_ = timer_state::queued;
+        timer.tick_ = _tick_of(timer.due_);
+        if (pending_ == 0) {
+          // the wheel stood still while it was empty
+          currentTick_ = std::max(currentTick_, _ticks_until(now()));
+        }
+        ++pending_;
+        if (!_place(timer)) {
+          // due already, run it now
+          --pending_;
+          timer.state_ = timer_state::expired;
+          post = true;
+        } else {
+          _drive_by(timer.tick_);
+        }
+      }
+    }
+    if (post) {
+      context_.post(&timer);
+    }
+  }
+
+  void _cancel(timer_item& timer) noexcept {
+    {
+      std::lock_guard lock{lock_};
+      if (timer.state_ == timer_state::idle) {
+        // stopped before it was inserted
+        timer.state_ = timer_state::cancelled;
+        return;
+      }
+      if (timer.state_ != timer_state::queued) {
+        // already expired
+        return;
+      }
+      _unlink(timer);
+      --pending_;
+      timer.state_ = timer_state::cancelled;
+    }
+    // the driver stays armed, a tick that finds nothing to do is cheap
+    context_.post(&timer);
+  }
+
+  // picks the list for timer.tick_. returns false when the tick has passed.
+  bool _place(timer_item& timer) noexcept {
+    const auto tick = timer.tick_;
+    if (tick <= currentTick_) {
+      return false;
+    }
+    for (std::size_t level = 0; level != levels; ++level) {
+      // the lowest level where the tick is in the current rotation
+      const auto shift = slot_bits * (level + 1);
+      if ((tick >> shift) == (currentTick_ >> shift)) {
+        const auto slot = (tick >> (slot_bits * level)) & slot_mask;
+        _link(timer, level, slot);
+        return true;
+      }
+    }
+    _link_to(timer, &overflow_);
+    return true;
+  }
+
+  void _link(timer_item& timer, std::size_t level, std::uint64_t slot) {
+    _link_to(timer, &wheel_[level * slots + slot]);
+    occupied_[level] |= std::uint64_t{1} << slot;
+  }
+
+  // clears the bit of a wheel slot that has become empty
+  void _vacate(timer_item** list) noexcept {
+    if (list != &overflow_) {
+      auto index = (std::size_t)(list - wheel_.data());
+      occupied_[index / slots] &= ~(std::uint64_t{1} << (index % slots));
+    }
+  }
+
+  void _link_to(timer_item& timer, timer_item** list) noexcept {
+    timer.list_ = list;
+    timer.prev_ = nullptr;
+    timer.next_ = *list;
+    if (!!*list) {
+      (*list)->prev_ = &timer;
+    }
+    *list = &timer;
+  }
+
+  void _unlink(timer_item& timer) noexcept {
+    (!!timer.prev_ ? timer.prev_->next_ : *timer.list_) = timer.next_;
+    if (!!timer.next_) {
+      timer.next_->prev_ = timer.prev_;
+    }
+    if (!*timer.list_) {
+      _vacate(timer.list_);
+    }
+    timer.prev_ = timer.next_ = nullptr;
+    timer.list_ = nullptr;
+  }
+
+  // takes a whole list out of the wheel
+  timer_item* _take(timer_item** list) noexcept {
+    timer_item* head = std::exchange(*list, nullptr);
+    _vacate(list);
+    for (auto* timer = head; !!timer; timer = timer->next_) {
+      timer->list_ = nullptr;
+    }
+    return head;
+  }
+
+  // moves the timers of a list down to the levels that now cover them,
+  // those that are due go to expired
+  void _cascade(timer_item** list, timer_item*& expired) noexcept {
+    auto* timer = _take(list);
+    while (!!timer) {
+      auto* next = std::exchange(timer->next_, nullptr);
+      timer->prev_ = nullptr;
+      if (!_place(*timer)) {
+        _expire(*timer, expired);
+      }
+      timer = next;
+    }
+  }
+
+  void _expire(timer_item& timer, timer_item*& expired) noexcept {
+    --pending_;
+    timer.state_ = timer_state::expired;
+    timer.next_ = expired;
+    expired = &timer;
+  }
+
+  // advances the wheel to now, collecting the timers that are due
+  timer_item* _advance(std::uint64_t nowTick) noexcept {
+    timer_item* expired = nullptr;
+    while (currentTick_ < nowTick && pending_ != 0) {
+      const auto tick = ++currentTick_;
+      if ((tick & ((std::uint64_t{1} << (slot_bits * levels)) - 1)) == 0) {
+        _cascade(&overflow_, expired);
+      }
+      for (std::size_t level = levels - 1; level != 0; --level) {
+        const auto shift = slot_bits * level;
+        if ((tick & ((std::uint64_t{1} << shift) - 1)) == 0) {
+          _cascade(
+              &wheel_[level * slots + ((tick >> shift) & slot_mask)],
+              expired);
+        }
+      }
+      auto* timer = _take(&wheel_[tick & slot_mask]);
+      while (!!timer) {
+        auto* next = timer->next_;
+        _expire(*timer, expired);
+        timer = next;
+      }
+    }
+    if (pending_ == 0) {
+      // nothing to tick for, skip the idle time in one step
+      currentTick_ = std::max(currentTick_, nowTick);
+    }
+    return expired;
+  }
+
+  // the next tick that has work, a level 0 slot or the next cascade
+  std::uint64_t _next_tick() const noexcept {
+    const auto slot = currentTick_ & slot_mask;
+    const auto later = slot == slot_mask
+        ? std::uint64_t{0}
+        : occupied_[0] & ~((std::uint64_t{2} << slot) - 1);
+    if (later != 0) {
+      return (currentTick_ & ~slot_mask) + std::countr_zero(later);
+    }
+    return (currentTick_ | slot_mask) + 1;
+  }
+
+  // lock_ held. makes sure the driver runs by tick.
+  void _drive_by(std::uint64_t tick) noexcept {
+    if (closing_) {
+      return;
+    }
+    if (!driving_) {
+      driving_ = true;
+      drivenTick_ = std::min(tick, _next_tick());
+      context_.arm(driver_, start_ + tick_ * drivenTick_);
+    } else if (tick < drivenTick_) {
+      // runs the driver now, it re-arms for the earlier tick
+      drivenTick_ = tick;
+      context_.disarm(driver_);
+    }
+  }
+
+  static void _drive(iocp_context::work_item* work) noexcept {
+    static_cast<driver*>(work)->self_->_tick();
+  }
+
+  void _tick() noexcept {
+    timer_item* expired = nullptr;
+    // the wheel may be gone once the lock is released
+    auto& context = context_;
+    {
+      std::lock_guard lock{lock_};
+      expired = _advance(_ticks_until(now()));
+      if (pending_ == 0 || closing_) {
+        driving_ = false;
+        idle_.notify_all();
+      } else {
+        drivenTick_ = _next_tick();
+        context_.arm(driver_, start_ + tick_ * drivenTick_);
+      }
+    }
+    // a batch per tick. the timer may be gone once it is posted
+    while (!!expired) {
+      context.post(std::exchange(expired, expired->next_));
+    }
+  }
+
+  iocp_context& context_;
+  const clock_t::duration tick_;
+  // tick 0
+  const time_point start_;
+  std::mutex lock_;
+  std::uint64_t currentTick_{0};
+  // slots of level l at [l * slots, (l + 1) * slots)
+  std::array<timer_item*, levels * slots> wheel_{};
+  // a bit per non-empty slot
+  std::array<std::uint64_t, levels> occupied_{};
+  timer_item* overflow_{nullptr};
+  // timers in the wheel
+  std::size_t pending_{0};
+  driver driver_;
+  // the driver is armed or running, and the tick it is armed for
+  bool driving_{false};
+  // notified when driving_ is cleared, for the destructor
+  std::condition_variable idle_;
+  std::uint64_t drivenTick_{0};
+  bool closing_{false};
+};
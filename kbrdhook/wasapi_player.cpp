@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "wasapi_player.hpp"
+
+#include <unifex/scope_guard.hpp>
+
+#include <avrt.h>
+#include <ksmedia.h>
+#include <mmdeviceapi.h>
+#pragma comment(lib, "avrt.lib")
+
+#include <algorithm>
+#include <cstdio>
+
+void WasapiPlayer::Check(HRESULT hr, const char* what) {
+  if (FAILED(hr)) {
+    printf("wasapi player: %s failed (hr=0x%X)\n", what, hr);
+    fflush(stdout);
+    std::terminate();
+  }
+}
+
+void WasapiPlayer::Render() noexcept {
+  Check(CoInitializeEx(nullptr, COINIT_MULTITHREADED), "CoInitializeEx");
+  unifex::scope_guard uninitialize{[]() noexcept { CoUninitialize(); }};
+
+  DWORD taskIndex = 0;
+  HANDLE task = AvSetMmThreadCharacteristicsW(L"Pro Audio", &taskIndex);
+  unifex::scope_guard revertTask{[&]() noexcept {
+    if (!!task) {
+      AvRevertMmThreadCharacteristics(task);
+    }
+  }};
+
+  IMMDeviceEnumerator* pEnumerator = nullptr;
+  Check(
+      CoCreateInstance(
+          __uuidof(MMDeviceEnumerator),
+          NULL,
+          CLSCTX_ALL,
+          IID_PPV_ARGS(&pEnumerator)),
+      "create device enumerator");
+  unifex::scope_guard releaseEnumerator{
+      [&]() noexcept { pEnumerator->Release(); }};
+
+  IMMDevice* pDevice = nullptr;
+  Check(
+      pEnumerator->GetDefaultAudioEndpoint(eRender, eConsole, &pDevice),
+      "GetDefaultAudioEndpoint");
+  unifex::scope_guard releaseDevice{[&]() noexcept { pDevice->Release(); }};
+
+  IAudioClient* pClient = nullptr;
+  Check(
+      pDevice->Activate(
+          __uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&pClient),
+      "activate audio client");
+  unifex::scope_guard releaseClient{[&]() noexcept { pClient->Release(); }};
+
+  // mix in the format the device uses, so the sample is converted once
+  WAVEFORMATEX* pFormat = nullptr;
+  Check(pClient->GetMixFormat(&pFormat), "GetMixFormat");
+  unifex::scope_guard freeFormat{[&]() noexcept { CoTaskMemFree(pFormat); }};
+  if (!IsFloat(*pFormat)) {
+    Check(E_NOTIMPL, "mixing to a non-float mix format");
+  }
+
+  const AUDCLNT_SHAREMODE mode =
+      exclusive_ ? AUDCLNT_SHAREMODE_EXCLUSIVE : AUDCLNT_SHAREMODE_SHARED;
+  REFERENCE_TIME duration = bufferDuration_;
+  if (exclusive_) {
+    Check(
+        pClient->IsFormatSupported(mode, pFormat, NULL),
+        "exclusive mode with the mix format");
+    REFERENCE_TIME defaultPeriod = 0;
+    REFERENCE_TIME minimumPeriod = 0;
+    Check(
+        pClient->GetDevicePeriod(&defaultPeriod, &minimumPeriod),
+        "GetDevicePeriod");
+    duration = std::max(duration, minimumPeriod);
+  }
+  HRESULT hr = pClient->Initialize(
+      mode,
+      AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+      duration,
+      exclusive_ ? duration : 0,
+      pFormat,
+      NULL);
+  if (hr == AUDCLNT_E_BUFFER_SIZE_NOT_ALIGNED) {
+    // exclusive mode wants a whole number of device frames, retry with
+    // the aligned size on a new client
+    UINT32 alignedFrames = 0;
+    Check(pClient->GetBufferSize(&alignedFrames), "GetBufferSize");
+    duration = (REFERENCE_TIME)(
+        10000.0 * 1000 * alignedFrames / pFormat->nSamplesPerSec + 0.5);
+    pClient->Release();
+    pClient = nullptr;
+    Check(
+        pDevice->Activate(
+            __uuidof(IAudioClient), CLSCTX_ALL, NULL, (void**)&pClient),
+        "activate audio client");
+    hr = pClient->Initialize(
+        mode,
+        AUDCLNT_STREAMFLAGS_EVENTCALLBACK,
+        duration,
+        duration,
+        pFormat,
+        NULL);
+  }
+  Check(hr, "initialize audio client");
+
+  click_sample sample;
+  Check(sample.load_file(samplePath_, pFormat), "load click sample");
+  const WAVEFORMATEX& sampleFormat = sample.format();
+  if (sampleFormat.nSamplesPerSec != pFormat->nSamplesPerSec ||
+      sampleFormat.nChannels != pFormat->nChannels ||
+      sampleFormat.nBlockAlign != pFormat->nBlockAlign) {
+    Check(E_FAIL, "convert the click sample to the mix format");
+  }
+  const UINT32 channels = pFormat->nChannels;
+  const auto* samples = reinterpret_cast<const float*>(sample.pcm());
+  const std::int64_t sampleFrames =
+      sample.pcm_bytes() / sampleFormat.nBlockAlign;
+
+  HANDLE bufferReady = CreateEventW(NULL, FALSE, FALSE, NULL);
+  if (!bufferReady) {
+    std::terminate();
+  }
+  unifex::scope_guard closeEvent{
+      [&]() noexcept { CloseHandle(bufferReady); }};
+  Check(pClient->SetEventHandle(bufferReady), "SetEventHandle");
+
+  UINT32 bufferFrames = 0;
+  Check(pClient->GetBufferSize(&bufferFrames), "GetBufferSize");
+
+  IAudioRenderClient* pRender = nullptr;
+  Check(pClient->GetService(IID_PPV_ARGS(&pRender)), "get render client");
+  unifex::scope_guard releaseRender{[&]() noexcept { pRender->Release(); }};
+
+  // start with a buffer of silence
+  BYTE* data = nullptr;
+  Check(pRender->GetBuffer(bufferFrames, &data), "GetBuffer");
+  Check(
+      pRender->ReleaseBuffer(bufferFrames, AUDCLNT_BUFFERFLAGS_SILENT),
+      "ReleaseBuffer");
+
+  Check(pClient->Start(), "start audio client");
+  printf(
+      "wasapi player started (%u frames at %luHz, %s)\n",
+      bufferFrames,
+      pFormat->nSamplesPerSec,
+      exclusive_ ? "exclusive" : "shared");
+  fflush(stdout);
+  renderReady_.set();
+
+  HANDLE waits[] = {stop_, bufferReady};
+  while (WaitForMultipleObjects(2, waits, FALSE, INFINITE) ==
+         WAIT_OBJECT_0 + 1) {
+    UINT32 frames = bufferFrames;
+    if (!exclusive_) {
+      UINT32 padding = 0;
+      Check(pClient->GetCurrentPadding(&padding), "GetCurrentPadding");
+      frames -= padding;
+    }
+    if (frames == 0) {
+      continue;
+    }
+    Check(pRender->GetBuffer(frames, &data), "GetBuffer");
+    bool audible = Mix(
+        reinterpret_cast<float*>(data),
+        frames,
+        channels,
+        samples,
+        sampleFrames);
+    Check(
+        pRender->ReleaseBuffer(
+            frames, audible ? 0 : AUDCLNT_BUFFERFLAGS_SILENT),
+        "ReleaseBuffer");
+    latency_trace::mark(latency_trace::play, std::exchange(startingAt_, 0));
+  }
+
+  pClient->Stop();
+  printf("wasapi player exit\n");
+  fflush(stdout);
+}
+
+bool WasapiPlayer::Mix(
+    float* out,
+    UINT32 frames,
+    UINT32 channels,
+    const float* sample,
+    std::int64_t sampleFrames) noexcept {
+  auto triggered = triggers_.exchange(0, std::memory_order_relaxed);
+  if (triggered != 0) {
+    startingAt_ = triggeredAt_.exchange(0, std::memory_order_relaxed);
+    latency_trace::mark(latency_trace::schedule, startingAt_);
+  }
+  for (size_t i = 0; i != std::min<size_t>(triggered, voices_.size()); ++i) {
+    // a free voice, or steal the one furthest into the sample
+    auto voice = std::find(voices_.begin(), voices_.end(), -1);
+    if (voice == voices_.end()) {
+      voice = std::max_element(voices_.begin(), voices_.end());
+    }
+    *voice = 0;
+  }
+
+  bool audible = false;
+  std::fill(out, out + frames * channels, 0.0f);
+  for (auto& position : voices_) {
+    if (position < 0) {
+      continue;
+    }
+    audible = true;
+    auto count =
+        std::min<std::int64_t>(frames, sampleFrames - position) * channels;
+    const float* in = sample + position * channels;
+    for (std::int64_t i = 0; i != count; ++i) {
+      out[i] += in[i];
+    }
+    position += count / channels;
+    if (position >= sampleFrames) {
+      position = -1;
+    }
+  }
+  if (audible) {
+    for (UINT32 i = 0; i != frames * channels; ++i) {
+      out[i] = std::clamp(out[i], -1.0f, 1.0f);
+    }
+  }
+  return audible;
+}
+
+bool WasapiPlayer::IsFloat(const WAVEFORMATEX& format) {
+  if (format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT) {
+    return true;
+  }
+  return format.wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+      reinterpret_cast<const WAVEFORMATEXTENSIBLE&>(format).SubFormat ==
+      KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+}
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) Kirk Shoop.
+ *
+ * Licensed under the Apache License Version 2.0 with LLVM Exceptions
+ * (the "License"); you may not use this file except in compliance with
+ * the License. You may obtain a copy of the License at
+ *
+ *   https://llvm.org/LICENSE.txt
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <unifex/async_manual_reset_event.hpp>
+#include <unifex/just_from.hpp>
+#include <unifex/scheduler_concepts.hpp>
+#include <unifex/sender_concepts.hpp>
+#include <unifex/sequence.hpp>
+
+#include "click_sample.hpp"
+#include "iocp_context.hpp"
+#include "latency_trace.hpp"
+
+#include <windows.h>
+#include <Audioclient.h>
+
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// a low-latency alternative to Player with the same start() / destroy() /
+// Click() interface. the preloaded sample is mixed straight into a WASAPI
+// event-driven render buffer, so a click costs one atomic increment and is
+// heard within one device period.
+struct WasapiPlayer {
+  using scheduler_t = decltype(std::declval<iocp_context>().get_scheduler());
+
+  // starts and joins the render thread, none of this needs the com thread
+  scheduler_t worker_;
+  PCWSTR samplePath_;
+  // requested device buffer (100ns units)
+  REFERENCE_TIME bufferDuration_;
+  bool exclusive_;
+  // lock-free trigger queue: Click() adds one, the render thread takes all
+  std::atomic<std::uint32_t> triggers_;
+  // hook time of the first traced click since the last period
+  std::atomic<latency_trace::stamp_t> triggeredAt_;
+  // hook time of the click started in the buffer being filled (render
+  // thread only)
+  latency_trace::stamp_t startingAt_;
+  // frame offset into the sample for each voice, -1 when idle (render
+  // thread only)
+  std::vector<std::int64_t> voices_;
+  HANDLE stop_;
+  std::thread renderThread_;
+  unifex::async_manual_reset_event renderReady_;
+
+  ~WasapiPlayer() {
+    if (renderThread_.joinable()) {
+      // must call destroy()
+      std::terminate();
+    }
+    CloseHandle(stop_);
+  }
+  explicit WasapiPlayer(
+      scheduler_t worker,
+      PCWSTR samplePath,
+      size_t voices = 8,
+      REFERENCE_TIME bufferDuration = 30000,  // 3ms
+      bool exclusive = false)
+    : worker_(worker)
+    , samplePath_(samplePath)
+    , bufferDuration_(bufferDuration)
+    , exclusive_(exclusive)
+    , triggers_(0)
+    , triggeredAt_(0)
+    , startingAt_(0)
+    , voices_(voices, -1)
+    , stop_(CreateEventW(NULL, TRUE, FALSE, NULL)) {
+    if (!stop_ || voices == 0) {
+      std::terminate();
+    }
+  }
+
+  [[nodiscard]] auto start() {
+    return unifex::sequence(
+        unifex::schedule(worker_),
+        unifex::just_from([this]() {
+          renderThread_ = std::thread([this]() noexcept { Render(); });
+        }),
+        renderReady_.async_wait());
+  }
+
+  [[nodiscard]] auto destroy() {
+    return unifex::sequence(
+        unifex::schedule(worker_), unifex::just_from([this]() noexcept {
+          if (renderThread_.joinable()) {
+            SetEvent(stop_);
+            renderThread_.join();
+          }
+        }));
+  }
+
+  void Click(latency_trace::stamp_t hookTime = 0) {
+    latency_trace::stamp_t none = 0;
+    (void)triggeredAt_.compare_exchange_strong(
+        none, hookTime, std::memory_order_relaxed);
+    triggers_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void Check(HRESULT hr, const char* what);
+
+  // the render thread, until stop_ is set
+  void Render() noexcept;
+
+  // starts the triggered voices and mixes every playing voice into out.
+  // returns false when nothing is playing.
+  bool Mix(
+      float* out,
+      UINT32 frames,
+      UINT32 channels,
+      const float* sample,
+      std::int64_t sampleFrames) noexcept;
+
+  static bool IsFloat(const WAVEFORMATEX& format);
+};